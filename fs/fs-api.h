@@ -1,11 +1,101 @@
-typedef void (*diskfunc)(int blocknum, void *buf);
+// Disk functions are handed back the 'dev' given to fs_open() to tell which
+// device to access. They move BLOCKSIZE sectors, whatever the block size of
+// the file system.
+typedef void (*diskfunc)(void *dev, int sector, void *buf);
+// Moves 'nsectors' consecutive sectors starting at 'sector' with a single
+// request. Sector i of the range goes from or to bufs[i].
+typedef void (*diskrangefunc)(void *dev, int sector, int nsectors,
+                              void **bufs);
+// Tells the device that the 'nsectors' consecutive sectors starting at
+// 'sector' hold nothing worth keeping, so it may release their storage.
+// Reading them back may then return anything.
+typedef void (*diskdiscardfunc)(void *dev, int sector, int nsectors);
 typedef int (*printfunc)(const char *fmt, ...);
 
-int fs_init(struct partition *p, diskfunc rfunc, diskfunc wfunc,
-            printfunc pfunc);
-int fs_format(struct partition *p);
-uint32_t fs_mknod(char *path, uint16_t type);
-uint32_t fs_lookup(char *path);
-int fs_geti(uint32_t inum, struct dinode *di);
-int fs_read(uint32_t inum, void *buf, int sz, uint32_t off);
-int fs_write(uint32_t inum, void *buf, int sz, uint32_t off);
+// Counters kept by the block buffer cache. 'nread' and 'nwrite' count file
+// system blocks actually transferred by the disk functions and 'nreq' the calls
+// made to them.
+struct fs_stats {
+        uint32_t nread;
+        uint32_t nwrite;
+        uint32_t nreq;
+        uint32_t nhit;  // Block lookups served from the cache
+        uint32_t nmiss; // Block lookups that had to claim a buffer
+        // File block mappings found in the in-core extents of the inode, and
+        // the ones that had to walk the pointers in the inode and its indirect
+        // blocks
+        uint32_t nmaphit;
+        uint32_t nmapmiss;
+        uint32_t nra;    // Blocks read ahead
+        uint32_t nrahit; // Blocks read ahead that were used afterwards
+        // Names found, or found missing, by the name cache, and the ones that
+        // had to be looked up in their directory
+        uint32_t nnamehit;
+        uint32_t nnamemiss;
+        uint32_t ncommit;  // Transactions committed to the log
+        uint32_t ndiscard; // Blocks discarded
+};
+
+// fs_format() flags
+#define FS_FORMAT_ZERO 0x1 // Zero the data blocks too
+#define FS_FORMAT_GROUPS 0x2 // Lay the file system out in block groups
+
+// Position in a directory being listed with fs_readdir()
+struct fs_dir {
+        uint32_t inum;
+        uint32_t off; // Offset of the next entry to look at
+        int flags;
+};
+
+// fs_opendir() flags
+#define FS_DIR_STAT 0x1 // Also read the inodes of the entries into the cache
+
+// A range of a file returned by fs_fiemap(): bytes consecutive on disk
+// starting at 'block,' a hole, or data kept in the inode
+struct fs_extent {
+        uint32_t off; // Offset in the file
+        uint32_t len; // Length in bytes
+        uint32_t block;
+        int flags;
+};
+
+// fs_extent flags
+#define FS_EXTENT_HOLE   0x1 // Reads as zeros, 'block' is 0
+#define FS_EXTENT_INLINE 0x2 // Kept in the inode (T_INLINE), 'block' is 0
+
+// State of a mounted partition, private to fs.c
+struct fs_mount;
+// A file opened with fs_fopen(), private to fs.c
+struct fs_file;
+
+struct fs_mount *fs_open(void *dev, diskfunc rfunc, diskfunc wfunc,
+                         printfunc pfunc);
+int fs_close(struct fs_mount *m);
+int fs_init(struct fs_mount *m, struct partition *p);
+int fs_setrange(struct fs_mount *m, diskrangefunc rfunc, diskrangefunc wfunc);
+int fs_setdiscard(struct fs_mount *m, diskdiscardfunc func);
+int fs_format(struct fs_mount *m, struct partition *p, uint32_t bsize,
+              int flags);
+int fs_sync(struct fs_mount *m);
+void fs_getstats(struct fs_mount *m, struct fs_stats *st);
+uint32_t fs_mknod(struct fs_mount *m, char *path, uint16_t type);
+int fs_unlink(struct fs_mount *m, char *path);
+uint32_t fs_clone(struct fs_mount *m, uint32_t src, char *path);
+int fs_compact(struct fs_mount *m, char *path);
+uint32_t fs_lookup(struct fs_mount *m, char *path);
+uint32_t fs_lookupat(struct fs_mount *m, uint32_t dir, char *path);
+int fs_opendir(struct fs_mount *m, uint32_t inum, struct fs_dir *dir,
+               int flags);
+int fs_readdir(struct fs_mount *m, struct fs_dir *dir, struct dirent *des,
+               int n);
+int fs_geti(struct fs_mount *m, uint32_t inum, struct dinode *di);
+int fs_read(struct fs_mount *m, uint32_t inum, void *buf, int sz, uint32_t off);
+int fs_write(struct fs_mount *m, uint32_t inum, void *buf, int sz,
+             uint32_t off);
+int fs_truncate(struct fs_mount *m, uint32_t inum, uint32_t size);
+int fs_fiemap(struct fs_mount *m, uint32_t inum, uint32_t off,
+              struct fs_extent *ext, int n);
+struct fs_file *fs_fopen(struct fs_mount *m, char *path);
+int fs_hread(struct fs_file *f, void *buf, int sz);
+int fs_hwrite(struct fs_file *f, void *buf, int sz);
+int fs_fclose(struct fs_file *f);
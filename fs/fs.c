@@ -16,22 +16,212 @@
 
 #define MAXPATH 64
 
-// Encapsulating global variables within a global unnamed struct
+// Number of mounts that can be in use at once. Each one has its own cache.
+#ifndef FS_NMOUNT
+#        define FS_NMOUNT 4
+#endif
+
+// Size of the buffer cache in BLOCKSIZE blocks and the number of hash chains
+// used to find them. Users size the cache for their own memory budget at
+// compile time, e.g., -DFS_NBUF=32 for the bootloader. A file system with
+// larger blocks gets proportionally fewer buffers, but at least NBUFMIN.
+#ifndef FS_NBUF
+#        define FS_NBUF 64
+#endif
+#define NBUCKET 31
+#define NBUFMIN (FS_NBUF < 8 ? FS_NBUF : 8)
+
+// Largest number of blocks moved by one ranged disk request. A run is held in
+// the cache while it is transferred, so it may only claim part of it. MAXRUN
+// bounds the runs of any file system while fs->maxrun is the bound for the
+// block size in use.
+#define MAXRUN (FS_NBUF / 2 < 32 ? FS_NBUF / 2 : 32)
+
+// Largest number of bitmap blocks of a file system we can mount, which bounds
+// its data blocks to 8 * MAXBITMAP times the block size, e.g., 1M blocks
+// (512 MB) with 512-byte blocks and 8M blocks (32 GB) with 4K blocks.
+#define MAXBITMAP 256
+
+// Largest number of blocks read ahead of a file read sequentially, 0 to turn
+// read-ahead off. The window starts at RAMIN blocks and doubles with each
+// read that continues the previous one.
+#ifndef FS_READAHEAD
+#        define FS_READAHEAD 16
+#endif
+#define RAMAX (FS_READAHEAD < fs->maxrun ? FS_READAHEAD : fs->maxrun)
+#define RAMIN (RAMAX < 4 ? RAMAX : 4)
+
+// Number of contiguous blocks reserved ahead for a file being written and the
+// number of files that can hold such a reservation at once.
+#ifndef FS_PREALLOC
+#        define FS_PREALLOC 16
+#endif
+#define NPREALLOC 8
+
+// Number of runs of freed blocks held until they're returned to the bitmap,
+// see bfree()
+#define NFREED 32
+
+// Number of inodes kept in memory and the number of extents each of them
+// remembers, see bmap()
+#ifndef FS_NINODE
+#        define FS_NINODE 32
+#endif
+#define NMAPCACHE 8
+
+// Number of name lookups remembered, see dir_lookup()
+#ifndef FS_NNAME
+#        define FS_NNAME 32
+#endif
+
+// Number of files a mount can have open at once. Each open file holds an
+// in-core inode, so this must stay well below FS_NINODE.
+#ifndef FS_NFILE
+#        define FS_NFILE 4
+#endif
+
+// A cached copy of one disk block. Buffers are threaded on a hash chain for
+// lookup by block number and on a doubly-linked LRU list for eviction.
+struct buf {
+        uint32_t blockno;
+        int valid; // Has data been read from disk?
+        int dirty; // Does data need to be written back to disk?
+        int ref;   // Number of users currently holding this buffer
+        int ra;    // Read ahead and not used yet?
+        // Changed metadata not logged yet, which mustn't be written back, and
+        // metadata logged but not written back yet, see log_commit()
+        int pinned;
+        int logged;
+        struct buf *hnext;
+        struct buf *prev; // LRU list, most recently used next to the head
+        struct buf *next;
+        uint8_t *data; // fs->bsize bytes
+};
+
+// An in-core copy of an on-disk inode
+struct inode {
+        uint32_t inum;
+        int valid;
+        int dirty;     // Does d need to be written back to its inode block?
+        int ref;       // Number of users currently holding this inode
+        uint32_t tick; // Time of the last use, for LRU replacement
+        struct dinode d;
+        // Extents found by bmap(): file blocks [fbn, fbn + len) are disk
+        // blocks [pbn, pbn + len).
+        struct {
+                uint32_t fbn;
+                uint32_t pbn;
+                uint32_t len; // 0 if unused
+        } map[NMAPCACHE];
+        int mapnext;   // Next extent slot to recycle
+        uint32_t goal; // Block following the last one allocated to the file
+        // Read-ahead state, see readahead_update()
+        uint32_t ralast; // Last file block touched by the previous read
+        uint32_t rawin;  // Current window size, 0 after a non-sequential read
+        uint32_t raend;  // File blocks below this one have been read ahead
+};
+
+// The result of looking up 'name' in directory 'dir,' NULLINUM if the name
+// isn't there. 'dir' is NULLINUM if the entry is unused.
+struct name {
+        uint32_t dir;
+        uint32_t inum;
+        char name[MAXNAME];
+};
+
+// An open file. It holds the in-core inode of the file until it's closed, so
+// the inode, along with the extents bmap() remembers and the read-ahead state,
+// stays in the table however many other files are accessed in the meantime.
+struct fs_file {
+        struct fs_mount *m;
+        struct inode *ip; // 0 if the handle is free
+        uint32_t pos;     // Offset of the next byte read or written
+};
+
+// Encapsulating the state of a mounted partition within a struct
 // not only organizes the code but also reduces naming conflicts
 // with local variables. This practice prevents serious consequences
 // and confusing bugs caused by compiler overrides without notification.
 // It also mitigates conflicts with global names; for example, a function
-// named fs.disk_read() in another C file won't conflict with fs.fs.disk_read.
+// named disk_read() in another C file won't conflict with fs->disk_read.
 // Of course, the use of the 'static' directive can also do that.
-static struct {
+struct fs_mount {
+        int inuse; // Taken from the pool by fs_open()?
         int init;
         struct superblock su;
         // User of this fs implemention must implement the three functions below
-        // in other C files compiled along with fs.c
+        // in other C files compiled along with fs.c, and pass them to
+        // fs_open() along with 'dev,' which is handed back to the disk
+        // functions to tell which device to access.
+        void *dev;
         diskfunc disk_read;
         diskfunc disk_write;
         printfunc printf;
-} fs;
+        // Optional, set by fs_setrange()
+        diskrangefunc disk_readv;
+        diskrangefunc disk_writev;
+        diskdiscardfunc disk_discard; // Optional, set by fs_setdiscard()
+        // Geometry derived from the block size of the file system
+        uint32_t bsize;    // Bytes per block
+        uint32_t spb;      // Disk sectors per block
+        uint32_t nptrs;    // Block pointers per indirect block
+        uint32_t ipb;      // Inodes per inode block
+        uint32_t ndirhash; // Slots of a directory hash index
+        int maxrun;        // Largest run of blocks moved at once
+        struct {
+                int nbuf; // Number of buffers in use, fewer for larger blocks
+                struct buf buf[FS_NBUF];
+                struct buf *hash[NBUCKET];
+                struct buf head;
+                uint32_t mem[FS_NBUF * BLOCKSIZE / 4]; // Their data
+        } bcache;
+        // In-memory copy of a segment of the free block bitmap, see
+        // bitmap_load(). It's read on the first allocation or free and
+        // written back by fs_sync().
+        struct {
+                int loaded; // Does 'words' hold segment 'seg?'
+                int dirty;
+                uint32_t seg;
+                uint32_t cursor; // Bit the next search starts from
+                uint32_t words[MAXBLOCKSIZE / 4];
+                // Free bits in each segment, NFREE_UNKNOWN until loaded
+                uint16_t nfree[MAXBITMAP];
+        } bitmap;
+        // Blocks reserved for files being written, see balloc()
+        struct {
+                uint32_t inum;
+                uint32_t next; // Next reserved block
+                uint32_t left; // Number of reserved blocks left
+        } prealloc[NPREALLOC];
+        int prealloc_clock; // Next slot to recycle
+        // Runs of blocks freed but not returned to the bitmap yet, see bfree()
+        struct {
+                uint32_t start;
+                uint32_t cnt;
+        } freed[NFREED];
+        int nfreed;
+        struct inode itable[FS_NINODE];
+        uint32_t iclock;
+        uint32_t icursor; // Inode the next search for a free one starts from
+        uint32_t dgroup;  // Last block group a directory was put in
+        struct fs_file files[FS_NFILE];
+        struct name ncache[FS_NNAME];
+        struct {
+                uint32_t seq; // Last transaction committed
+                int npinned;  // Pinned buffers
+                int live;     // Are blocks it logged left to write back?
+                int syncing;  // In log_sync()?
+        } log;
+        struct fs_stats stats;
+};
+
+// Mounts are taken from a static pool since the bootloader has no allocator.
+static struct fs_mount mounts[FS_NMOUNT];
+
+// The mount the current call operates on. Every public function but fs_open()
+// points it at the mount it's given before doing anything else, so that the
+// rest of the code needn't pass it around.
+static struct fs_mount *fs;
 
 #define assert(expr)                                                           \
         do {                                                                   \
@@ -44,329 +234,2174 @@ static void panic()
                 ;
 }
 
-static uint32_t bitmap_alloc()
+// Block buffer cache
+//
+// All block accesses go through bread()/bwrite()/brelse() rather than
+// straight to the disk functions. Writes are delayed: bwrite() only marks the
+// buffer dirty and the block reaches the disk when its buffer is evicted or
+// when fs_sync() is called. Consecutive blocks are moved with one ranged disk
+// request when the user provides ranged disk functions.
+
+// Transfer 'cnt' consecutive blocks starting at block n from or to 'bufs.'
+// The disk functions move sectors, so blocks larger than a sector are handed
+// to them as the run of sectors they cover.
+static void disk_rw(uint32_t n, int cnt, void **bufs, int w)
+{
+        diskrangefunc f = w ? fs->disk_writev : fs->disk_readv;
+        void *secs[MAXRUN * (MAXBLOCKSIZE / BLOCKSIZE)];
+        uint32_t s = fs->su.start + (n - fs->su.start) * fs->spb;
+        int nsec = cnt * fs->spb;
+        if (fs->spb > 1) {
+                assert(cnt <= MAXRUN);
+                for (int i = 0; i < nsec; i++)
+                        secs[i] = (uint8_t *)bufs[i / fs->spb] +
+                                  i % fs->spb * BLOCKSIZE;
+                bufs = secs;
+        }
+        if (f && nsec > 1) {
+                f(fs->dev, s, nsec, bufs);
+                fs->stats.nreq++;
+        } else {
+                for (int i = 0; i < nsec; i++)
+                        (w ? fs->disk_write : fs->disk_read)(fs->dev, s + i,
+                                                             bufs[i]);
+                fs->stats.nreq += nsec;
+        }
+        if (w)
+                fs->stats.nwrite += cnt;
+        else
+                fs->stats.nread += cnt;
+}
+
+static void disk_read(uint32_t n, void *buf) { disk_rw(n, 1, &buf, 0); }
+
+// Tell the device, if it wants to know, that the 'cnt' blocks starting at
+// block n are free.
+static void disk_discard(uint32_t n, uint32_t cnt)
+{
+        if (!fs->disk_discard) return;
+        fs->disk_discard(fs->dev, fs->su.start + (n - fs->su.start) * fs->spb,
+                         cnt * fs->spb);
+        fs->stats.ndiscard += cnt;
+}
+
+static void lru_unlink(struct buf *b)
+{
+        b->prev->next = b->next;
+        b->next->prev = b->prev;
+}
+
+static void lru_push(struct buf *b)
+{
+        b->next = fs->bcache.head.next;
+        b->prev = &fs->bcache.head;
+        fs->bcache.head.next->prev = b;
+        fs->bcache.head.next = b;
+}
+
+static void hash_remove(struct buf *b)
 {
-        union block b;
-        fs.disk_read(fs.su.sbitmap, &b);
-        for (int i = 0; i < fs.su.nblock_dat / 8; i++) {
-                if (b.bytes[i] == 0xff) continue;
-                // bytes[i] must has at least one 0 bit
-                int off;
-                for (off = 0; off < 8; off++)
-                        if (!((b.bytes[i] >> off) & 1)) break;
-                if (off + i * 8 >= fs.su.nblock_dat) return 0;
-                assert(off != 8);
-                b.bytes[i] |= 1 << off;
-                fs.disk_write(fs.su.sbitmap, &b);
-                return off + i * 8 + fs.su.sdata;
+        struct buf **pp = &fs->bcache.hash[b->blockno % NBUCKET];
+        for (; *pp; pp = &(*pp)->hnext)
+                if (*pp == b) {
+                        *pp = b->hnext;
+                        return;
+                }
+}
+
+// Drop every cached block. Dirty blocks are lost, so callers that care must
+// call fs_sync() first.
+static void binit()
+{
+        fs->bcache.head.prev = &fs->bcache.head;
+        fs->bcache.head.next = &fs->bcache.head;
+        for (int i = 0; i < NBUCKET; i++)
+                fs->bcache.hash[i] = 0;
+        fs->log.npinned = 0;
+        for (int i = 0; i < fs->bcache.nbuf; i++) {
+                struct buf *b = &fs->bcache.buf[i];
+                b->valid = b->dirty = b->ref = b->ra = 0;
+                b->pinned = b->logged = 0;
+                b->hnext = 0;
+                b->data = (uint8_t *)fs->bcache.mem + i * fs->bsize;
+                lru_push(b);
         }
+}
+
+// Set up the mount for blocks of 'bsize' bytes, dropping every cached block.
+// Return -1 if that isn't a valid block size or the cache can't hold enough
+// blocks of that size.
+static int bsetsize(uint32_t bsize)
+{
+        if (bsize < BLOCKSIZE || bsize > MAXBLOCKSIZE ||
+            (bsize & (bsize - 1)) || FS_NBUF * BLOCKSIZE / bsize < NBUFMIN)
+                return -1;
+        fs->bsize = bsize;
+        fs->spb = bsize / BLOCKSIZE;
+        fs->nptrs = bsize / sizeof(uint32_t);
+        fs->ipb = bsize / sizeof(struct dinode);
+        fs->ndirhash = (bsize - sizeof(struct dirhash)) / sizeof(uint16_t);
+        fs->bcache.nbuf = FS_NBUF * BLOCKSIZE / bsize;
+        fs->maxrun = fs->bcache.nbuf / 2;
+        if (fs->maxrun > MAXRUN) fs->maxrun = MAXRUN;
+        binit();
         return 0;
 }
 
-static int bitmap_free(uint32_t n)
+static struct buf *blookup(uint32_t n)
 {
-        union block b;
-        if (n < fs.su.sdata || n >= fs.su.sdata + fs.su.nblock_dat) return -1;
-        fs.disk_read(fs.su.sbitmap, &b);
-        // Double free?
-        if (!(b.bytes[n / 8] & (1 << (n % 8)))) return -1;
-        b.bytes[n / 8] &= ~(1 << (n % 8));
-        fs.disk_write(fs.su.sbitmap, &b);
+        struct buf *b;
+        for (b = fs->bcache.hash[n % NBUCKET]; b; b = b->hnext)
+                if (b->valid && b->blockno == n) return b;
         return 0;
 }
 
-static int rw_inode(uint32_t inum, struct dinode *p, int w)
+#define WRITABLE(b) ((b)->dirty && !(b)->pinned)
+
+// Write back the dirty, unpinned buffer b along with the ones cached for its
+// neighboring blocks, all in one request.
+static void bwriteback(struct buf *b)
 {
-        union block b;
-        if (!fs.init) {
-                fs.printf("uninitialized\n");
-                return -1;
+        struct buf *run[MAXRUN];
+        void *bufs[MAXRUN];
+        struct buf *p;
+        int cnt = 0;
+        for (int i = 1;
+             i < fs->maxrun && (p = blookup(b->blockno - 1)) && WRITABLE(p);
+             i++, b = p)
+                ;
+        for (; b && WRITABLE(b) && cnt < fs->maxrun;
+             b = blookup(b->blockno + 1)) {
+                run[cnt] = b;
+                bufs[cnt++] = b->data;
         }
-        if (inum >= fs.su.ninodes) {
-                fs.printf("inum %d out of bounds\n", inum);
-                return -1;
+        disk_rw(run[0]->blockno, cnt, bufs, 1);
+        for (int i = 0; i < cnt; i++)
+                run[i]->dirty = run[i]->logged = 0;
+}
+
+static void log_commit();
+static void log_sync();
+
+// Number of buffers log_sync() may need to bring the bitmap and the inodes to
+// the cache: one per dirty inode at worst, but no more than half the cache.
+static int log_reserve()
+{
+        int n = 1;
+        for (int i = 0; i < FS_NINODE; i++)
+                n += fs->itable[i].valid && fs->itable[i].dirty;
+        return n < fs->bcache.nbuf / 2 ? n : fs->bcache.nbuf / 2;
+}
+
+// Return a held buffer for block n, which may not contain valid data yet.
+static struct buf *bget(uint32_t n)
+{
+        struct buf *b;
+lookup:
+        for (b = fs->bcache.hash[n % NBUCKET]; b; b = b->hnext)
+                if (b->blockno == n) {
+                        fs->stats.nhit++;
+                        if (b->ra) {
+                                b->ra = 0;
+                                fs->stats.nrahit++;
+                        }
+                        goto found;
+                }
+        // Recycle the least recently used buffer nobody is holding. Pinned
+        // buffers have to be committed first once the others run low, while
+        // enough are left for log_sync() to commit the bitmap and the inodes
+        // along with them. Only if log_sync() itself runs out do the pinned
+        // buffers get committed alone. Committing may bring block n itself to
+        // the cache, so it's looked up again.
+        int need = fs->log.npinned && !fs->log.syncing ? log_reserve() : 0;
+        int nfree = 0;
+        b = &fs->bcache.head;
+        for (struct buf *p = fs->bcache.head.prev;
+             p != &fs->bcache.head && nfree <= need; p = p->prev)
+                if (!p->ref && !p->pinned && !nfree++) b = p;
+        if (fs->log.npinned && nfree <= need) {
+                if (fs->log.syncing)
+                        log_commit();
+                else
+                        log_sync();
+                goto lookup;
+        }
+        // Every buffer is held. FS_NBUF is too small.
+        assert(b != &fs->bcache.head);
+        if (b->valid) {
+                if (b->dirty) bwriteback(b);
+                hash_remove(b);
+        }
+        b->blockno = n;
+        b->valid = b->dirty = b->ra = 0;
+        b->hnext = fs->bcache.hash[n % NBUCKET];
+        fs->bcache.hash[n % NBUCKET] = b;
+        fs->stats.nmiss++;
+found:
+        b->ref++;
+        lru_unlink(b);
+        lru_push(b);
+        return b;
+}
+
+static struct buf *bread(uint32_t n)
+{
+        struct buf *b = bget(n);
+        if (!b->valid) {
+                disk_read(n, b->data);
+                b->valid = 1;
+        }
+        return b;
+}
+
+// Return held buffers for the 'cnt' consecutive blocks starting at block n in
+// 'bs,' reading the ones not cached yet with as few disk requests as possible.
+static void breadrun(uint32_t n, int cnt, struct buf **bs)
+{
+        void *bufs[MAXRUN];
+        int i, j;
+        assert(cnt <= fs->maxrun);
+        for (i = 0; i < cnt; i++)
+                bs[i] = bget(n + i);
+        for (i = 0; i < cnt; i = j) {
+                for (j = i; j < cnt && !bs[j]->valid; j++)
+                        bufs[j - i] = bs[j]->data;
+                if (j == i) {
+                        j++;
+                        continue;
+                }
+                disk_rw(n + i, j - i, bufs, 0);
+                for (int k = i; k < j; k++)
+                        bs[k]->valid = 1;
+        }
+}
+
+// Mark held buffer b, which holds metadata, changed. With FEAT_LOG, it's
+// pinned in the cache until logged.
+static void bwrite(struct buf *b)
+{
+        if (fs->su.features & FEAT_LOG && !b->pinned) {
+                b->pinned = 1;
+                fs->log.npinned++;
+        }
+        b->dirty = 1;
+}
+
+// Mark held buffer b, which holds file data, changed. Data isn't logged.
+static void bwrite_data(struct buf *b) { b->dirty = 1; }
+
+// Return a held buffer for block n filled with zeros without reading the
+// block, for blocks whose old contents are meaningless (e.g., freshly
+// allocated ones). It's marked changed, as metadata if 'meta.'
+static struct buf *bclear(uint32_t n, int meta)
+{
+        struct buf *b = bget(n);
+        memset(b->data, 0, fs->bsize);
+        b->valid = 1;
+        if (meta)
+                bwrite(b);
+        else
+                bwrite_data(b);
+        return b;
+}
+
+// Move the 'cnt' consecutive blocks starting at block n straight between the
+// disk and 'bufs,' bypassing the cache. Cached copies of the blocks are kept
+// coherent: a read takes cached blocks, which may be newer than the disk's,
+// from the cache and a write brings them up to date and marks them clean.
+static void bdirect(uint32_t n, int cnt, void **bufs, int w)
+{
+        struct buf *b;
+        int i, j;
+        if (w) {
+                disk_rw(n, cnt, bufs, 1);
+                for (i = 0; i < cnt; i++)
+                        if ((b = blookup(n + i))) {
+                                memcpy(b->data, bufs[i], fs->bsize);
+                                b->dirty = b->logged = 0;
+                        }
+                return;
+        }
+        for (i = 0; i < cnt; i = j) {
+                if ((b = blookup(n + i))) {
+                        memcpy(bufs[i], b->data, fs->bsize);
+                        if (b->ra) {
+                                b->ra = 0;
+                                fs->stats.nrahit++;
+                        }
+                        j = i + 1;
+                        continue;
+                }
+                for (j = i + 1; j < cnt && !blookup(n + j); j++)
+                        ;
+                disk_rw(n + i, j - i, &bufs[i], 0);
+        }
+}
+
+static void brelse(struct buf *b)
+{
+        assert(b->ref > 0);
+        b->ref--;
+}
+
+// Drop the cached copy of block n, whose contents no longer matter (e.g.,
+// it has just been freed), and make its buffer the first to be recycled.
+static void bforget(uint32_t n)
+{
+        struct buf *b = blookup(n);
+        if (!b || b->ref) return;
+        hash_remove(b);
+        if (b->pinned) fs->log.npinned--;
+        b->valid = b->dirty = b->ra = 0;
+        b->pinned = b->logged = 0;
+        lru_unlink(b);
+        b->next = &fs->bcache.head;
+        b->prev = fs->bcache.head.prev;
+        fs->bcache.head.prev->next = b;
+        fs->bcache.head.prev = b;
+}
+
+// Read the blocks among the 'cnt' consecutive ones starting at block n that
+// aren't cached yet into the cache, in as few requests as possible, without
+// holding on to them.
+static void bprefetch(uint32_t n, int cnt)
+{
+        struct buf *bs[MAXRUN];
+        void *bufs[MAXRUN];
+        int i, j;
+        assert(cnt <= fs->maxrun);
+        for (i = 0; i < cnt; i++)
+                bs[i] = blookup(n + i) ? 0 : bget(n + i);
+        // Getting a buffer may commit, which brings the inodes and the bitmap
+        // to the cache, so blocks found missing may be cached by now and
+        // mustn't be read over.
+        for (i = 0; i < cnt; i = j) {
+                for (j = i; j < cnt && bs[j] && !bs[j]->valid; j++)
+                        bufs[j - i] = bs[j]->data;
+                if (j == i) {
+                        j++;
+                        continue;
+                }
+                disk_rw(n + i, j - i, bufs, 0);
+                for (int k = i; k < j; k++)
+                        bs[k]->valid = bs[k]->ra = 1;
+                fs->stats.nra += j - i;
+        }
+        for (i = 0; i < cnt; i++)
+                if (bs[i]) brelse(bs[i]);
+}
+
+// Write every dirty buffer but the pinned ones back to disk.
+static void bflush()
+{
+        for (int i = 0; i < fs->bcache.nbuf; i++) {
+                struct buf *b = &fs->bcache.buf[i];
+                if (b->valid && WRITABLE(b)) bwriteback(b);
         }
-        fs.disk_read(fs.su.sinode + inum / NINODES_PER_BLOCK, &b);
+}
+
+// Log
+//
+// With FEAT_LOG, metadata buffers changed with bwrite() are pinned in the
+// cache, neither recycled nor written back, until log_commit() writes them to
+// the log as a transaction. That happens on fs_sync(), at the start of a call
+// changing the file system once enough changes have piled up, and when the
+// cache runs low on buffers that aren't pinned. A commit in the middle of a
+// call may only save part of it, but the others save whole calls.
+//
+// Committed buffers are written home lazily, like any other dirty buffer, so
+// a block changed over and over is written home once. Buffers still not
+// written home by the next commit are logged again along with the new
+// changes, so that the last transaction alone holds everything not written
+// home yet and replaying it is enough. When they don't fit together, the
+// blocks of the previous transaction are written home first, and the new
+// changes committed in pieces, each one written home before the next.
+
+// Read or write the header of half h of the log, which fits in the first
+// sector of its first block, bypassing the cache.
+static void log_head(int h, struct logheader *lh, int w)
+{
+        uint8_t sec[BLOCKSIZE] = {0};
+        uint32_t n = fs->su.slog + h * LOGHALF;
+        uint32_t s = fs->su.start + (n - fs->su.start) * fs->spb;
         if (w) {
-                b.inodes[inum % NINODES_PER_BLOCK] = *p;
-                fs.disk_write(fs.su.sinode + inum / NINODES_PER_BLOCK, &b);
+                memcpy(sec, lh, sizeof *lh);
+                fs->disk_write(fs->dev, s, sec);
+                fs->stats.nwrite++;
+        } else {
+                fs->disk_read(fs->dev, s, sec);
+                memcpy(lh, sec, sizeof *lh);
+                fs->stats.nread++;
+        }
+        fs->stats.nreq++;
+}
+
+// Write the 'cnt' buffers in 'bs' to the log and commit them.
+static void log_write(struct buf **bs, int cnt)
+{
+        struct logheader lh = {LOGMAGIC, fs->log.seq + 1, cnt};
+        void *bufs[LOGSIZE];
+        uint32_t n = fs->su.slog + lh.seq % 2 * LOGHALF + 1;
+        for (int i = 0; i < cnt; i++) {
+                bufs[i] = bs[i]->data;
+                lh.blocks[i] = bs[i]->blockno;
+        }
+        for (int i = 0; i < cnt; i += fs->maxrun)
+                disk_rw(n + i, cnt - i < fs->maxrun ? cnt - i : fs->maxrun,
+                        &bufs[i], 1);
+        log_head(lh.seq % 2, &lh, 1);
+        fs->log.seq = lh.seq;
+        fs->log.live = 1;
+        fs->stats.ncommit++;
+        for (int i = 0; i < cnt; i++) {
+                if (bs[i]->pinned) fs->log.npinned--;
+                bs[i]->pinned = 0;
+                bs[i]->logged = 1;
+        }
+}
+
+static void log_commit()
+{
+        struct buf *bs[LOGSIZE];
+        struct buf *b;
+        int i, n = 0, cnt = 0;
+        if (!fs->log.npinned) return;
+        for (i = 0; i < fs->bcache.nbuf; i++)
+                if (fs->bcache.buf[i].pinned || fs->bcache.buf[i].logged) n++;
+        if (n > LOGSIZE)
+                for (i = 0; i < fs->bcache.nbuf; i++)
+                        if (fs->bcache.buf[i].logged &&
+                            WRITABLE(&fs->bcache.buf[i]))
+                                bwriteback(&fs->bcache.buf[i]);
+        // Blocks of the previous transaction changed since can't be written
+        // home, so they go first, in the first piece. They fit, since the
+        // previous transaction did.
+        for (i = 0; i < 2 * fs->bcache.nbuf; i++) {
+                b = &fs->bcache.buf[i % fs->bcache.nbuf];
+                if (i < fs->bcache.nbuf ? !b->logged : !b->pinned || b->logged)
+                        continue;
+                bs[cnt++] = b;
+                if (cnt < LOGSIZE) continue;
+                log_write(bs, cnt);
+                for (int j = 0; fs->log.npinned && j < cnt; j++)
+                        if (bs[j]->logged) bwriteback(bs[j]);
+                cnt = 0;
+        }
+        if (cnt) log_write(bs, cnt);
+}
+
+// Once everything logged has been written home, there's nothing to replay.
+static void log_clear()
+{
+        struct logheader lh = {LOGMAGIC, fs->log.seq, 0};
+        if (!fs->log.live) return;
+        log_head(lh.seq % 2, &lh, 1);
+        fs->log.live = 0;
+}
+
+// Write home the blocks of the last transaction committed, which may not all
+// have been written home before the file system was last used.
+static void log_replay()
+{
+        struct logheader lh[2];
+        struct buf *bs[LOGSIZE];
+        void *bufs[LOGSIZE];
+        log_head(0, &lh[0], 0);
+        log_head(1, &lh[1], 0);
+        int h = lh[1].magic == LOGMAGIC &&
+                (lh[0].magic != LOGMAGIC || lh[1].seq > lh[0].seq);
+        fs->log.seq = lh[h].magic == LOGMAGIC ? lh[h].seq : 0;
+        fs->log.live = 0;
+        if (lh[h].magic != LOGMAGIC || !lh[h].n || lh[h].n > LOGSIZE) return;
+        uint32_t n = fs->su.slog + h * LOGHALF + 1;
+        for (uint32_t i = 0; i < lh[h].n; i += fs->maxrun) {
+                int cnt = lh[h].n - i < fs->maxrun ? lh[h].n - i : fs->maxrun;
+                for (int j = 0; j < cnt; j++) {
+                        bs[j] = bget(lh[h].blocks[i + j]);
+                        bufs[j] = bs[j]->data;
+                }
+                disk_rw(n + i, cnt, bufs, 0);
+                for (int j = 0; j < cnt; j++) {
+                        bs[j]->valid = bs[j]->dirty = 1;
+                        brelse(bs[j]);
+                }
+        }
+        bflush();
+        fs->log.live = 1;
+        log_clear();
+}
+
+static void bitmap_flush();
+static void prealloc_release_all();
+static void iflush();
+static void bfree_release();
+static void bfree_discard();
+
+// Bring all metadata held in memory to the cache and commit it. Blocks freed
+// since the last commit are returned to the bitmap once everything else is in
+// the cache, so that the commit that frees them also drops the pointers to
+// them, and discarded once it's done.
+static void log_sync()
+{
+        fs->log.syncing = 1;
+        prealloc_release_all();
+        bitmap_flush();
+        iflush();
+        bfree_release();
+        bitmap_flush();
+        log_commit();
+        bfree_discard();
+        fs->log.syncing = 0;
+}
+
+// Called by the calls changing the file system before they do anything, when
+// it's consistent: commit if half a log's worth of changes are pinned.
+static void log_begin()
+{
+        if (fs->log.npinned >= LOGSIZE / 2) log_sync();
+}
+
+// Write all metadata held in memory and then every dirty buffer back to disk.
+static void sync_all()
+{
+        log_sync();
+        bflush();
+        log_clear();
+}
+
+int fs_sync(struct fs_mount *m)
+{
+        fs = m;
+        if (!fs->init) {
+                fs->printf("uninitialized\n");
+                return -1;
+        }
+        sync_all();
+        return 0;
+}
+
+void fs_getstats(struct fs_mount *m, struct fs_stats *st) { *st = m->stats; }
+
+int fs_setrange(struct fs_mount *m, diskrangefunc rfunc, diskrangefunc wfunc)
+{
+        fs = m;
+        fs->disk_readv = rfunc;
+        fs->disk_writev = wfunc;
+        return 0;
+}
+
+int fs_setdiscard(struct fs_mount *m, diskdiscardfunc func)
+{
+        fs = m;
+        fs->disk_discard = func;
+        return 0;
+}
+
+// Free block bitmap
+//
+// Bit i of the bitmap tracks data block bitblock(i). On disk, bit i is bit
+// i % 8 of byte i / 8, which on our little-endian machines is also bit i % 32
+// of 32-bit word i / 32, letting us skip over 32 blocks at a time.
+//
+// Each bitmap block is a segment tracking SEGBITS data blocks. One segment is
+// kept in memory at a time, and the number of free bits of every segment
+// loaded is remembered, so that searches skip the segments known to be too
+// full without reading them. A run of blocks allocated at once never crosses
+// a segment boundary.
+
+#define SEGBITS      (fs->bsize * 8)
+#define NFREE_UNKNOWN 0xffff
+// Bit i, which must be in the segment in memory
+#define BITSET(i)    (fs->bitmap.words[(i) % SEGBITS / 32] >> ((i) % 32) & 1)
+#define NOBLOCK      0xffffffff
+
+// Block groups
+//
+// With FEAT_GROUPS, each bitmap block sits in a group of its own, between the
+// inode blocks of the group and the data blocks it tracks, so that files can
+// keep their inode and their data close together. Inodes and bits are still
+// numbered across the whole file system; these translate them to blocks.
+
+#define GROUPS  (fs->su.features & FEAT_GROUPS)
+// Inode blocks in a group
+#define GINODE  (fs->su.ninodes_group / fs->ipb)
+#define IGROUP(inum) ((inum) / fs->su.ninodes_group)
+
+// Block holding inode 'inum'
+static uint32_t iblock(uint32_t inum)
+{
+        uint32_t i = inum / fs->ipb;
+        if (!GROUPS) return fs->su.sinode + i;
+        return fs->su.sinode + i / GINODE * fs->su.nblock_group + i % GINODE;
+}
+
+// Bitmap block of segment 'seg'
+static uint32_t segblock(uint32_t seg)
+{
+        return fs->su.sbitmap + seg * (GROUPS ? fs->su.nblock_group : 1);
+}
+
+// Data block tracked by bit i
+static uint32_t bitblock(uint32_t i)
+{
+        if (!GROUPS) return fs->su.sdata + i;
+        return fs->su.sdata + i / SEGBITS * fs->su.nblock_group + i % SEGBITS;
+}
+
+// Bit tracking block n, or NOBLOCK if n isn't a data block
+static uint32_t blockbit(uint32_t n)
+{
+        if (n < fs->su.sdata) return NOBLOCK;
+        n -= fs->su.sdata;
+        if (!GROUPS) return n;
+        if (n % fs->su.nblock_group >= SEGBITS) return NOBLOCK;
+        return n / fs->su.nblock_group * SEGBITS + n % fs->su.nblock_group;
+}
+
+// Number of data blocks the bitmap can track.
+static uint32_t bitmap_nbits()
+{
+        uint32_t max = fs->su.nblock_bitmap * SEGBITS;
+        return fs->su.nblock_dat < max ? fs->su.nblock_dat : max;
+}
+
+// Forget the bitmap of the previous partition.
+static void bitmap_init()
+{
+        fs->bitmap.loaded = 0;
+        fs->bitmap.cursor = 0;
+        for (int i = 0; i < MAXBITMAP; i++)
+                fs->bitmap.nfree[i] = NFREE_UNKNOWN;
+}
+
+static void bitmap_flush()
+{
+        if (!fs->bitmap.loaded || !fs->bitmap.dirty) return;
+        struct buf *b = bget(segblock(fs->bitmap.seg));
+        memcpy(b->data, fs->bitmap.words, fs->bsize);
+        b->valid = 1;
+        bwrite(b);
+        brelse(b);
+        fs->bitmap.dirty = 0;
+}
+
+// Bring segment 'seg' into memory, writing back the one there if it changed,
+// and count its free bits if they aren't known yet.
+static void bitmap_load(uint32_t seg)
+{
+        if (fs->bitmap.loaded && fs->bitmap.seg == seg) return;
+        bitmap_flush();
+        struct buf *b = bread(segblock(seg));
+        memcpy(fs->bitmap.words, b->data, fs->bsize);
+        brelse(b);
+        fs->bitmap.loaded = 1;
+        fs->bitmap.dirty = 0;
+        fs->bitmap.seg = seg;
+        if (fs->bitmap.nfree[seg] == NFREE_UNKNOWN) {
+                uint32_t nbits = bitmap_nbits();
+                uint32_t n = 0;
+                for (uint32_t i = seg * SEGBITS;
+                     i < (seg + 1) * SEGBITS && i < nbits; i++) {
+                        uint32_t w = fs->bitmap.words[i % SEGBITS / 32];
+                        if (i % 32 == 0 && nbits - i >= 32 &&
+                            (w == 0xffffffff || !w)) {
+                                n += w ? 0 : 32;
+                                i += 31;
+                        } else
+                                n += !BITSET(i);
+                }
+                fs->bitmap.nfree[seg] = n;
+        }
+}
+
+// Find the first run of 'n' free bits that lies within [lo, hi), which must
+// be in the segment in memory. Return the first bit of the run or NOBLOCK.
+static uint32_t bitmap_scan(uint32_t lo, uint32_t hi, uint32_t n)
+{
+        uint32_t run = 0;
+        uint32_t start = 0;
+        for (uint32_t i = lo; i < hi;) {
+                uint32_t w = fs->bitmap.words[i % SEGBITS / 32];
+                // Whole words that are either all used or all free
+                if (i % 32 == 0 && hi - i >= 32 && (w == 0xffffffff || !w)) {
+                        if (w) {
+                                run = 0;
+                        } else {
+                                if (!run) start = i;
+                                run += 32;
+                        }
+                        i += 32;
+                } else {
+                        if (BITSET(i)) {
+                                run = 0;
+                        } else {
+                                if (!run) start = i;
+                                run++;
+                        }
+                        i++;
+                }
+                if (run >= n) return start;
+        }
+        return NOBLOCK;
+}
+
+// Find the first run of 'n' free bits searching from bit 'from' up to the end
+// and then wrapping around. Return the first bit of the run, with its segment
+// in memory, or NOBLOCK.
+static uint32_t bitmap_find(uint32_t from, uint32_t n)
+{
+        uint32_t nbits = bitmap_nbits();
+        uint32_t nseg = (nbits + SEGBITS - 1) / SEGBITS;
+        if (!n || n > nbits || n > SEGBITS) return NOBLOCK;
+        if (from >= nbits) from = 0;
+        // The rest of the segment of 'from,' the segments after it, and at
+        // last the start of the segment of 'from' again.
+        uint32_t seg = from / SEGBITS;
+        for (uint32_t k = 0; k <= nseg; k++, seg = (seg + 1) % nseg) {
+                uint32_t lo = seg * SEGBITS;
+                uint32_t hi = nbits - lo < SEGBITS ? nbits : lo + SEGBITS;
+                if (fs->bitmap.nfree[seg] < n) continue;
+                if (k == 0) lo = from;
+                if (k == nseg && from + n - 1 < hi) hi = from + n - 1;
+                bitmap_load(seg);
+                uint32_t i = bitmap_scan(lo, hi, n);
+                if (i != NOBLOCK) return i;
         }
-        *p = b.inodes[inum % NINODES_PER_BLOCK];
+        return NOBLOCK;
+}
+
+// Mark bits [i, i + n), which are in the segment in memory, used.
+static void bitmap_set(uint32_t i, uint32_t n)
+{
+        for (uint32_t j = i; j < i + n; j++)
+                fs->bitmap.words[j % SEGBITS / 32] |= 1u << (j % 32);
+        fs->bitmap.nfree[fs->bitmap.seg] -= n;
+        fs->bitmap.dirty = 1;
+}
+
+// Mark the 'cnt' data blocks starting at block n free, clearing whole words at
+// a time. Return -1 if any of them isn't a data block or is free already.
+static int bitmap_free(uint32_t n, uint32_t cnt)
+{
+        uint32_t nbits = bitmap_nbits();
+        uint32_t i = blockbit(n), end;
+        if (i == NOBLOCK || !cnt || cnt > nbits || i > nbits - cnt ||
+            blockbit(n + cnt - 1) != i + cnt - 1)
+                return -1;
+        for (end = i + cnt; i < end;
+             i = (i / 32 + 1) * 32) {
+                uint32_t lo = i % 32;
+                uint32_t hi = end - i + lo < 32 ? end - i + lo : 32;
+                uint32_t mask = (hi < 32 ? (1u << hi) - 1 : 0xffffffff) &
+                                ~((1u << lo) - 1);
+                bitmap_load(i / SEGBITS);
+                uint32_t *w = &fs->bitmap.words[i % SEGBITS / 32];
+                // Double free?
+                if ((*w & mask) != mask) return -1;
+                *w &= ~mask;
+                fs->bitmap.nfree[fs->bitmap.seg] += hi - lo;
+                fs->bitmap.dirty = 1;
+        }
+        return 0;
+}
+
+// Reference counts
+//
+// fs_clone() makes files share data blocks. Blocks shared by several files
+// have a count of the files sharing them besides the first in the reference
+// count file, one byte per data block, which blocks never shared leave as
+// holes. Freeing a shared block only drops a reference to it, and a file
+// about to write to one first gets its own copy (see bunshare()). The file
+// is created by the first fs_clone() and hidden from every directory.
+
+static int inode_rw(uint32_t inum, void *buf, int sz, uint32_t off, int w);
+
+// Return the number of references to data block n besides the first.
+static int refcount(uint32_t n)
+{
+        uint8_t c = 0;
+        if (fs->su.features & FEAT_REFLINK && blockbit(n) != NOBLOCK)
+                inode_rw(fs->su.irefcount, &c, 1, blockbit(n), 0);
+        return c;
+}
+
+// Add a reference to data block n, or drop one if 'delta' is -1. Return -1
+// if the count can't go that high or the file system is full.
+static int refcount_add(uint32_t n, int delta)
+{
+        int c = refcount(n) + delta;
+        uint8_t b = c;
+        if (c > 0xff) return -1;
+        if (inode_rw(fs->su.irefcount, &b, 1, blockbit(n), 1) != 1) return -1;
         return 0;
 }
 
-static int read_inode(uint32_t inum, struct dinode *p)
+// Drop a reference to block n if it's shared. Return whether it was, as the
+// block must then not be freed.
+static int bunref(uint32_t n)
+{
+        if (!refcount(n)) return 0;
+        refcount_add(n, -1);
+        return 1;
+}
+
+// Blocks being freed are gathered into runs of consecutive blocks, each
+// returned to the bitmap and discarded at once. Their cached copies are
+// dropped so that they aren't written back for nothing.
+//
+// With FEAT_LOG, the runs are only returned by the next log_sync(), right
+// before its commit: until then, the last transaction committed may still
+// point to the blocks, so they mustn't be reused. Whatever pointed to a block
+// must be changed in memory before the block is freed, so that the commit
+// drops the pointer along with the block. They're only discarded after that
+// commit, as a crash before it would bring the pointers back.
+
+// Return the blocks freed so far to the bitmap.
+static void bfree_release()
+{
+        for (int i = 0; i < fs->nfreed; i++)
+                assert(!bitmap_free(fs->freed[i].start, fs->freed[i].cnt));
+}
+
+// Discard the blocks returned to the bitmap by bfree_release(), which may
+// only be done once nothing left to replay needs their contents, and forget
+// them.
+static void bfree_discard()
+{
+        for (int i = 0; i < fs->nfreed; i++)
+                disk_discard(fs->freed[i].start, fs->freed[i].cnt);
+        fs->nfreed = 0;
+}
+
+// Called by the calls freeing blocks when they're done. Without FEAT_LOG,
+// there's no commit to wait for.
+static void bfree_done()
+{
+        if (fs->su.features & FEAT_LOG) return;
+        bfree_release();
+        bfree_discard();
+}
+
+// Free the single block n, which nothing points to anymore.
+static void bfree(uint32_t n)
+{
+        int i = fs->nfreed;
+        bforget(n);
+        if (i && fs->freed[i - 1].start + fs->freed[i - 1].cnt == n) {
+                fs->freed[i - 1].cnt++;
+                return;
+        }
+        fs->freed[i].start = n;
+        fs->freed[i].cnt = 1;
+        if ((fs->nfreed = i + 1) < NFREED) return;
+        if (fs->su.features & FEAT_LOG)
+                log_sync();
+        else
+                bfree_done();
+}
+
+// Free block n, or drop a reference to it if it's shared.
+static void bdrop(uint32_t n)
+{
+        if (!bunref(n)) bfree(n);
+}
+
+// Locality-aware block allocation
+//
+// Blocks are allocated as close as possible after a goal block, usually the
+// one following the block the file had before. On top of that, a file being
+// written gets a window of up to FS_PREALLOC contiguous blocks reserved in
+// the bitmap, and allocations for it are served from the window as long as
+// they continue it, so that files written at the same time don't interleave
+// on disk. Reserved blocks nobody used are returned to the bitmap by
+// fs_sync(), or when a handle on the file is closed.
+
+static void prealloc_release(int i)
+{
+        if (fs->prealloc[i].left)
+                assert(!bitmap_free(fs->prealloc[i].next, fs->prealloc[i].left));
+        fs->prealloc[i].left = 0;
+        fs->prealloc[i].inum = NULLINUM;
+}
+
+// Return the blocks reserved for inode 'inum,' if any.
+static void prealloc_drop(uint32_t inum)
+{
+        for (int i = 0; i < NPREALLOC; i++)
+                if (fs->prealloc[i].inum == inum) prealloc_release(i);
+}
+
+static void prealloc_release_all()
+{
+        for (int i = 0; i < NPREALLOC; i++)
+                prealloc_release(i);
+}
+
+// Allocate a block for inode 'inum,' preferably 'goal.' Pass 0 for no goal,
+// which with block groups means the group of the inode.
+static uint32_t balloc(uint32_t inum, uint32_t goal)
+{
+        uint32_t nbits = bitmap_nbits();
+        uint32_t bit, end, n;
+        int i;
+        for (i = 0; i < NPREALLOC; i++)
+                if (fs->prealloc[i].inum == inum) break;
+        if (i < NPREALLOC) {
+                if (fs->prealloc[i].left &&
+                    (!goal || goal == fs->prealloc[i].next)) {
+                        fs->prealloc[i].left--;
+                        return fs->prealloc[i].next++;
+                }
+                // The file isn't continuing its window. Reserve a new one.
+                prealloc_release(i);
+        } else {
+                i = fs->prealloc_clock;
+                fs->prealloc_clock = (i + 1) % NPREALLOC;
+                prealloc_release(i);
+        }
+        // Take as much as we can right at the goal, or else the first large
+        // enough run after it, settling for shorter runs on a fragmented disk.
+        // Without one, carry on from the previous allocation, unless that
+        // was in another group than the one of the inode.
+        if ((bit = blockbit(goal)) >= nbits) {
+                bit = fs->bitmap.cursor < nbits ? fs->bitmap.cursor : 0;
+                if (GROUPS && bit / SEGBITS != IGROUP(inum))
+                        bit = IGROUP(inum) * SEGBITS;
+        }
+        // The run at the goal ends with its segment.
+        bitmap_load(bit / SEGBITS);
+        end = (bit / SEGBITS + 1) * SEGBITS;
+        if (end > nbits) end = nbits;
+        for (n = 0; n < FS_PREALLOC && bit + n < end && !BITSET(bit + n); n++)
+                ;
+        if (!n) {
+                uint32_t from = bit;
+                for (n = FS_PREALLOC; n; n /= 2)
+                        if ((bit = bitmap_find(from, n)) != NOBLOCK) break;
+                // Blocks freed since the last commit can be had after the
+                // next one.
+                if (!n && fs->nfreed) {
+                        log_sync();
+                        return balloc(inum, goal);
+                }
+                if (!n) return 0;
+        }
+        bitmap_set(bit, n);
+        if (!goal) fs->bitmap.cursor = bit + n;
+        fs->prealloc[i].inum = inum;
+        fs->prealloc[i].next = bitblock(bit) + 1;
+        fs->prealloc[i].left = n - 1;
+        return bitblock(bit);
+}
+
+// In-core inodes
+//
+// Inodes are accessed through a small table of in-core copies, so that
+// repeated accesses to the same file don't go through its inode block every
+// time. iget() returns a held in-core inode and iput() releases it. Like
+// buffers, modified inodes are marked dirty and written back to their inode
+// block when their slot is recycled or by fs_sync().
+
+static void iinit()
+{
+        for (int i = 0; i < FS_NINODE; i++) {
+                fs->itable[i].valid = fs->itable[i].dirty = fs->itable[i].ref = 0;
+                fs->itable[i].tick = 0;
+        }
+        fs->iclock = 1;
+        fs->icursor = 0;
+        fs->dgroup = 0;
+        // Open files lose the inodes they held.
+        for (int i = 0; i < FS_NFILE; i++)
+                fs->files[i].ip = 0;
+        // Names looked up belong to the previous partition too.
+        for (int i = 0; i < FS_NNAME; i++)
+                fs->ncache[i].dir = NULLINUM;
+}
+
+static void iwriteback(struct inode *ip)
+{
+        struct buf *b = bread(iblock(ip->inum));
+        ((struct dinode *)b->data)[ip->inum % fs->ipb] = ip->d;
+        bwrite(b);
+        brelse(b);
+        ip->dirty = 0;
+}
+
+static void iflush()
+{
+        for (int i = 0; i < FS_NINODE; i++)
+                if (fs->itable[i].valid && fs->itable[i].dirty)
+                        iwriteback(&fs->itable[i]);
+}
+
+// Return the in-core inode 'inum' if it's in the table, without holding it.
+static struct inode *ilookup(uint32_t inum)
+{
+        for (int i = 0; i < FS_NINODE; i++)
+                if (fs->itable[i].valid && fs->itable[i].inum == inum)
+                        return &fs->itable[i];
+        return 0;
+}
+
+static void map_clear(struct inode *ip)
+{
+        for (int i = 0; i < NMAPCACHE; i++)
+                ip->map[i].len = 0;
+        ip->mapnext = 0;
+}
+
+static struct inode *iget(uint32_t inum)
+{
+        struct inode *ip = 0;
+        if (!fs->init) {
+                fs->printf("uninitialized\n");
+                return 0;
+        }
+        if (inum >= fs->su.ninodes) {
+                fs->printf("inum %d out of bounds\n", inum);
+                return 0;
+        }
+        if (!(ip = ilookup(inum))) {
+                // Recycle the least recently used inode nobody is holding.
+                for (int i = 0; i < FS_NINODE; i++)
+                        if (!fs->itable[i].ref &&
+                            (!ip || fs->itable[i].tick < ip->tick))
+                                ip = &fs->itable[i];
+                // Every inode is held. FS_NINODE is too small.
+                assert(ip);
+                if (ip->valid && ip->dirty) iwriteback(ip);
+                struct buf *b = bread(iblock(inum));
+                ip->d = ((struct dinode *)b->data)[inum % fs->ipb];
+                brelse(b);
+                ip->inum = inum;
+                ip->valid = 1;
+                ip->dirty = 0;
+                map_clear(ip);
+                ip->goal = 0;
+                ip->ralast = NOBLOCK;
+                ip->rawin = ip->raend = 0;
+        }
+        ip->ref++;
+        ip->tick = fs->iclock++;
+        return ip;
+}
+
+static void iput(struct inode *ip)
+{
+        assert(ip->ref > 0);
+        ip->ref--;
+}
+
+static int rw_inode(uint32_t inum, struct dinode *p, int w)
+{
+        struct inode *ip;
+        if (!(ip = iget(inum))) return -1;
+        if (w) {
+                ip->d = *p;
+                ip->dirty = 1;
+        }
+        *p = ip->d;
+        iput(ip);
+        return 0;
+}
+
+static int read_inode(uint32_t inum, struct dinode *p)
+{
+        return rw_inode(inum, p, 0);
+}
+
+static int write_inode(uint32_t inum, struct dinode *p)
+{
+        return rw_inode(inum, p, 1);
+}
+
+int fs_geti(struct fs_mount *m, uint32_t inum, struct dinode *p)
+{
+        fs = m;
+        return read_inode(inum, p);
+}
+
+// Given a index into the 'ptrs' array in an inode,
+// this function returns the indirection level of the
+// pointer entry - if it's a direct, singly-indirect,
+// or a doubly-indirect pointer.
+static int get_ilevel(int ptr_idx)
+{
+        if (ptr_idx < NDIRECT)
+                return 0;
+        else if (ptr_idx < NDIRECT + NINDRECT)
+                return 1;
+        else
+                return 2;
+}
+
+// Allocate an inode of type 'type' for a file in directory 'parent,' or
+// NULLINUM if none. With block groups, files go in the group of their
+// directory, and directories in turn go in each group, ext2-style, so that
+// every directory has room for its files next to it.
+uint32_t alloc_inode(uint16_t type, uint32_t parent)
+{
+        // Invalid inode type, return error
+        if ((type & 0xff) > T_DEV ||
+            (type & ~0xff & ~(T_EXTENTS | T_INLINE))) {
+                fs->printf("alloc_inode: %d: Invalid type\n", type);
+                return NULLINUM;
+        }
+        // Loop through all blocks for inode, next-fit from the block where
+        // the previous search left off, or from the start of the group
+        // picked for the inode
+        uint32_t first = fs->icursor / fs->ipb;
+        if (GROUPS && parent != NULLINUM) {
+                uint32_t g = IGROUP(parent);
+                if ((type & 0xff) == T_DIR) {
+                        fs->dgroup = (fs->dgroup + 1) % fs->su.nblock_bitmap;
+                        g = fs->dgroup;
+                }
+                if (IGROUP(fs->icursor) != g) first = g * GINODE;
+        }
+        for (uint32_t k = 0; k < fs->su.nblock_inode; k++) {
+                uint32_t i = (first + k) % fs->su.nblock_inode;
+                // Read current inode block to the buffer
+                struct buf *b = bread(iblock(i * fs->ipb));
+                struct dinode *inodes = (struct dinode *)b->data;
+                for (int j = 0; j < fs->ipb; j++) {
+                        uint32_t inum = i * fs->ipb + j;
+                        // The last block may have room past the last inode.
+                        if (inum >= fs->su.ninodes) break;
+                        // The in-core copy, if any, is the up-to-date one.
+                        struct inode *ip = ilookup(inum);
+                        // Found a unallocated inode
+                        if (!(ip ? ip->d.type : inodes[j].type)) {
+                                brelse(b);
+                                assert(ip = iget(inum));
+                                memset(&ip->d, 0, sizeof(ip->d));
+                                ip->d.type = type;
+                                ip->dirty = 1;
+                                map_clear(ip);
+                                iput(ip);
+                                fs->icursor = inum + 1;
+                                return inum;
+                        }
+                }
+                brelse(b);
+        }
+        fs->printf("alloc_inode: Out of inodes\n");
+        return NULLINUM;
+}
+
+// Block map
+//
+// bmap() translates a block number within a file to the disk block holding
+// it. Indirect blocks are cached like any other block, but on top of that
+// each in-core inode remembers a few extents, runs of file blocks found to be
+// consecutive on disk, so that mapping a block of a file read sequentially or
+// at random usually takes no block lookup at all.
+
+static uint32_t map_lookup(struct inode *ip, uint32_t fbn)
+{
+        for (int i = 0; i < NMAPCACHE; i++)
+                if (fbn >= ip->map[i].fbn &&
+                    fbn - ip->map[i].fbn < ip->map[i].len)
+                        return ip->map[i].pbn + (fbn - ip->map[i].fbn);
+        return 0;
+}
+
+static void map_add(struct inode *ip, uint32_t fbn, uint32_t pbn,
+                    uint32_t len)
+{
+        int i;
+        // Grow an extent this one continues, as happens when appending.
+        for (i = 0; i < NMAPCACHE; i++)
+                if (ip->map[i].len && ip->map[i].fbn + ip->map[i].len == fbn &&
+                    ip->map[i].pbn + ip->map[i].len == pbn) {
+                        ip->map[i].len += len;
+                        return;
+                }
+        i = ip->mapnext;
+        ip->mapnext = (i + 1) % NMAPCACHE;
+        ip->map[i].fbn = fbn;
+        ip->map[i].pbn = pbn;
+        ip->map[i].len = len;
+}
+
+// bmap() 'alloc' value asking for new data blocks to be zeroed
+#define BMAP_ZERO 2
+// bmap() 'alloc' value asking for a new data block even if there's one
+#define BMAP_REMAP 3
+
+// Extent-mapped files
+//
+// A file with T_EXTENTS maps its blocks with a list of extents instead of
+// block pointers (see struct extent), so that a file laid out contiguously on
+// disk is mapped by a single extent however large it is. Reading the extent
+// block, if the file has one, is the only metadata lookup its mapping needs.
+
+// Largest number of extents a file can have
+#define NEXTENTS (NIEXTENTS + fs->bsize / sizeof(struct extent))
+
+// Return extent i of file ip. Extents past the inode are in its extent block,
+// which is read into *bp the first time it's needed and held until the caller
+// releases it.
+static struct extent *extent_at(struct inode *ip, uint32_t i, struct buf **bp)
+{
+        if (i < NIEXTENTS) return &((struct extent *)ip->d.ptrs)[i];
+        if (!*bp) *bp = bread(EXTBLOCK(&ip->d));
+        return &((struct extent *)(*bp)->data)[i - NIEXTENTS];
+}
+
+// Return the number of extents of file ip, whose first 'i' are known to be
+// in use.
+static uint32_t extent_count(struct inode *ip, uint32_t i, struct buf **bp)
+{
+        for (; i < NEXTENTS; i++)
+                if ((i == NIEXTENTS && !EXTBLOCK(&ip->d)) ||
+                    !extent_at(ip, i, bp)->len)
+                        break;
+        return i;
+}
+
+// Make room for 'n' more extents after the 'cnt' ones of file ip, allocating
+// its extent block if they no longer fit in the inode. Return -1 if the file
+// can't have that many extents.
+static int extent_room(struct inode *ip, uint32_t cnt, uint32_t n,
+                       struct buf **bp)
+{
+        uint32_t eb;
+        if (cnt + n > NEXTENTS) return -1;
+        if (cnt + n <= NIEXTENTS || EXTBLOCK(&ip->d)) return 0;
+        if (!(eb = balloc(ip->inum, ip->goal))) return -1;
+        EXTBLOCK(&ip->d) = eb;
+        ip->dirty = 1;
+        *bp = bclear(eb, 1);
+        return 0;
+}
+
+// Insert 'e' as extent i of the 'cnt' extents of file ip, or merge it into
+// extent i - 1 if it continues it. There must be room for it. Return the
+// number of extents added.
+static int extent_insert(struct inode *ip, uint32_t i, uint32_t cnt,
+                         struct extent e, struct buf **bp)
+{
+        struct extent *prev = i ? extent_at(ip, i - 1, bp) : 0;
+        if (prev && (prev->start ? prev->start + prev->len == e.start
+                                 : !e.start)) {
+                prev->len += e.len;
+                return 0;
+        }
+        for (uint32_t j = cnt; j > i; j--)
+                *extent_at(ip, j, bp) = *extent_at(ip, j - 1, bp);
+        *extent_at(ip, i, bp) = e;
+        return 1;
+}
+
+// bmap() for extent-mapped files
+static uint32_t emap(struct inode *ip, uint32_t fbn, int alloc, uint32_t *need)
+{
+        struct buf *b = 0;
+        struct extent *e;
+        struct extent *last = 0;
+        uint32_t base = 0; // First file block of extent i
+        uint32_t pbn = 0;
+        uint32_t i, cnt, goal;
+        int in = 0; // Is fbn in extent i?
+        for (i = 0; i < NEXTENTS; i++) {
+                if (i == NIEXTENTS) {
+                        if (!EXTBLOCK(&ip->d)) break;
+                        if (need && !blookup(EXTBLOCK(&ip->d))) {
+                                *need = EXTBLOCK(&ip->d);
+                                return 0;
+                        }
+                }
+                e = extent_at(ip, i, &b);
+                if (!e->len) break;
+                if ((in = fbn - base < e->len)) break;
+                base += e->len;
+                last = e;
+        }
+        if (in && e->start && alloc != BMAP_REMAP) {
+                // Remember the whole extent.
+                pbn = e->start + (fbn - base);
+                map_add(ip, base, e->start, e->len);
+                goto out;
+        }
+        if (!alloc) goto out;
+        if (in) {
+                // fbn is in a hole, or in an extent when remapping, which is
+                // split around the new block.
+                uint32_t before = fbn - base, after = e->len - before - 1;
+                cnt = extent_count(ip, i + 1, &b);
+                if (extent_room(ip, cnt, 2, &b) < 0) goto out;
+                goal = last && last->start ? last->start + last->len : ip->goal;
+                if (!(pbn = balloc(ip->inum, goal))) goto out;
+                e = extent_at(ip, i, &b);
+                struct extent x = {pbn, 1};
+                struct extent rest = {e->start ? e->start + before + 1 : 0,
+                                      after};
+                if (before) {
+                        e->len = before;
+                        cnt += extent_insert(ip, ++i, cnt, x, &b);
+                        if (after) extent_insert(ip, i + 1, cnt, rest, &b);
+                } else if (after) {
+                        *e = rest;
+                        extent_insert(ip, i, cnt, x, &b);
+                } else
+                        e->start = pbn;
+        } else {
+                // fbn is past the last extent, after a hole if it doesn't
+                // follow it.
+                struct extent hole = {0, fbn - base};
+                cnt = i;
+                if (extent_room(ip, cnt, 2, &b) < 0) goto out;
+                goal = last && last->start && fbn == base
+                           ? last->start + last->len
+                           : ip->goal;
+                if (!(pbn = balloc(ip->inum, goal))) goto out;
+                struct extent x = {pbn, 1};
+                if (fbn > base) cnt += extent_insert(ip, cnt, cnt, hole, &b);
+                extent_insert(ip, cnt, cnt, x, &b);
+        }
+        if (alloc == BMAP_ZERO) brelse(bclear(pbn, 0));
+        ip->goal = pbn + 1;
+        ip->dirty = 1;
+        if (b) bwrite(b);
+        map_add(ip, fbn, pbn, 1);
+out:
+        if (b) brelse(b);
+        return pbn;
+}
+
+// Return the disk block holding block 'fbn' of the file, or 0 if it's a hole.
+// With 'alloc,' holes are filled with newly allocated blocks, along with any
+// indirect block needed to reach them, and 0 means we ran out of blocks.
+// Freed blocks keep their old contents on disk, so with 'alloc' BMAP_ZERO,
+// for callers about to write only part of the block, a new data block is also
+// zeroed in the cache rather than read. With BMAP_REMAP, the block is
+// replaced by a new one if it's mapped already, which is left for the caller
+// to fill or free.
+// Given 'need,' bmap() doesn't read indirect blocks that aren't cached but
+// returns 0 and stores the number of the first such block in *need.
+static uint32_t bmap(struct inode *ip, uint32_t fbn, int alloc, uint32_t *need)
+{
+        uint32_t *pp;      // The pointer to follow next
+        uint32_t *ptrs;    // The array of pointers pp is in
+        uint32_t nptrs;    // and its length
+        uint32_t idx[2];   // Index to follow in each level of indirect blocks
+        int level;         // Number of levels of indirect blocks
+        struct buf *b = 0; // Indirect block ptrs is in, if any
+        uint32_t pbn = 0;
+        uint32_t n = fbn;
+        if (alloc == BMAP_REMAP)
+                map_clear(ip);
+        else if ((pbn = map_lookup(ip, fbn))) {
+                fs->stats.nmaphit++;
+                return pbn;
+        }
+        fs->stats.nmapmiss++;
+        if (ip->d.type & T_EXTENTS) return emap(ip, fbn, alloc, need);
+        if (n < NDIRECT) {
+                pp = &ip->d.ptrs[n];
+                level = 0;
+        } else if ((n -= NDIRECT) < NINDRECT * fs->nptrs) {
+                pp = &ip->d.ptrs[NDIRECT + n / fs->nptrs];
+                idx[0] = n % fs->nptrs;
+                level = 1;
+        } else if ((n -= NINDRECT * fs->nptrs) <
+                   NDINDRECT * fs->nptrs * fs->nptrs) {
+                pp = &ip->d.ptrs[NDIRECT + NINDRECT +
+                                 n / (fs->nptrs * fs->nptrs)];
+                idx[0] = n / fs->nptrs % fs->nptrs;
+                idx[1] = n % fs->nptrs;
+                level = 2;
+        } else
+                return 0; // Beyond the largest possible file
+        ptrs = ip->d.ptrs;
+        nptrs = NDIRECT;
+        for (int l = 0;; l++) {
+                if (!*pp || (l == level && alloc == BMAP_REMAP)) {
+                        if (!alloc) goto out;
+                        // Prefer the block after the previous one in the
+                        // same array of pointers.
+                        uint32_t i = pp - ptrs;
+                        uint32_t goal =
+                            i && ptrs[i - 1] ? ptrs[i - 1] + 1 : ip->goal;
+                        uint32_t new = balloc(ip->inum, goal);
+                        if (!new) goto out;
+                        *pp = new;
+                        ip->goal = new + 1;
+                        // A new indirect block must not point anywhere yet.
+                        if (l < level || alloc == BMAP_ZERO)
+                                brelse(bclear(*pp, l < level));
+                        if (b)
+                                bwrite(b);
+                        else
+                                ip->dirty = 1;
+                }
+                if (l == level) break;
+                if (need && !blookup(*pp)) {
+                        *need = *pp;
+                        goto out;
+                }
+                struct buf *next = bread(*pp);
+                if (b) brelse(b);
+                b = next;
+                ptrs = (uint32_t *)b->data;
+                nptrs = fs->nptrs;
+                pp = &ptrs[idx[l]];
+        }
+        // Remember how far the run of consecutive blocks starting here goes
+        // within this array of pointers.
+        pbn = *pp;
+        n = 1;
+        for (uint32_t i = pp - ptrs; i + n < nptrs && ptrs[i + n] == pbn + n;
+             n++)
+                ;
+        map_add(ip, fbn, pbn, n);
+out:
+        if (b) brelse(b);
+        return pbn;
+}
+
+// Give file ip its own copy of block 'fbn,' mapped to disk block 'pbn,' if
+// that one is shared with other files, with the old contents if 'copy.'
+// Return the disk block now mapped, or 0 if out of blocks.
+static uint32_t bunshare(struct inode *ip, uint32_t fbn, uint32_t pbn,
+                         int copy)
+{
+        uint32_t new;
+        if (ip->inum == fs->su.irefcount || !refcount(pbn)) return pbn;
+        if (!(new = bmap(ip, fbn, BMAP_REMAP, 0))) return 0;
+        if (copy) {
+                struct buf *from = bread(pbn);
+                struct buf *to = bget(new);
+                memcpy(to->data, from->data, fs->bsize);
+                to->valid = 1;
+                bwrite_data(to);
+                brelse(to);
+                brelse(from);
+        }
+        refcount_add(pbn, -1);
+        return new;
+}
+
+// Data blocks are not transferred one by one but gathered into a run of
+// blocks consecutive both in the file and on disk, which is then moved with a
+// single disk request. A run of whole blocks is moved straight between the
+// disk and the caller's buffer; only runs of partial blocks go through the
+// cache, which supplies the rest of each block.
+struct run {
+        int w;          // Write? Read if 0
+        int meta;       // Metadata? Logged, unlike data, see irw()
+        int direct;     // Whole blocks only?
+        uint32_t block; // First disk block of the run
+        int cnt;        // Number of blocks in the run
+        uint32_t off;   // File offset where the run starts
+        char *buf;      // Position in the caller's buffer where the run starts
+        uint32_t len;   // Number of bytes covered by the run
+};
+
+// Transfer the pending run of data blocks.
+static void run_flush(struct run *r)
+{
+        struct buf *bs[MAXRUN];
+        uint32_t off = r->off;
+        char *buf = r->buf;
+        uint32_t left = r->len;
+        if (!r->cnt) return;
+        if (r->direct) {
+                void *bufs[MAXRUN];
+                for (int i = 0; i < r->cnt; i++)
+                        bufs[i] = buf + i * fs->bsize;
+                bdirect(r->block, r->cnt, bufs, r->w);
+                r->cnt = 0;
+                return;
+        }
+        breadrun(r->block, r->cnt, bs);
+        for (int i = 0; i < r->cnt; i++) {
+                uint32_t start = off % fs->bsize;
+                int sz = left < fs->bsize - start ? left : fs->bsize - start;
+                if (r->w) {
+                        memcpy(bs[i]->data + start, buf, sz);
+                        if (r->meta)
+                                bwrite(bs[i]);
+                        else
+                                bwrite_data(bs[i]);
+                } else
+                        memcpy(buf, bs[i]->data + start, sz);
+                brelse(bs[i]);
+                buf += sz;
+                left -= sz;
+                off += sz;
+        }
+        r->cnt = 0;
+}
+
+// Add 'sz' bytes of disk block 'pbn,' starting at file offset 'off' and
+// position 'buf' in the caller's buffer, to the pending run, or start a new
+// run if they don't continue it.
+static void run_add(struct run *r, uint32_t pbn, uint32_t off, char *buf,
+                    uint32_t sz)
+{
+        // Logged blocks have to go through the cache.
+        int direct = off % fs->bsize == 0 && sz == fs->bsize &&
+                     !(r->w && r->meta && fs->su.features & FEAT_LOG);
+        if (r->cnt && (pbn != r->block + r->cnt || buf != r->buf + r->len ||
+                       direct != r->direct || r->cnt == fs->maxrun))
+                run_flush(r);
+        if (!r->cnt) {
+                r->direct = direct;
+                r->block = pbn;
+                r->off = off;
+                r->buf = buf;
+                r->len = 0;
+        }
+        r->cnt++;
+        r->len += sz;
+}
+
+// Read blocks [fbn, fbn + n) of the file into the cache, along with the
+// indirect blocks needed to find them. Blocks consecutive on disk are read
+// with a single request, an indirect block together with the data blocks
+// preceding it.
+static void readahead(struct inode *ip, uint32_t fbn, uint32_t n)
+{
+        uint32_t start = 0, cnt = 0;
+        uint32_t end = fbn + n;
+        for (;;) {
+                uint32_t need = 0;
+                uint32_t pbn = fbn < end ? bmap(ip, fbn, 0, &need) : 0;
+                if (need) pbn = need;
+                if (cnt && (pbn != start + cnt || cnt == RAMAX)) {
+                        bprefetch(start, cnt);
+                        cnt = 0;
+                }
+                if (fbn >= end) break;
+                if (pbn && !cnt++) start = pbn;
+                if (need) {
+                        // Map fbn again once the indirect block is cached.
+                        bprefetch(start, cnt);
+                        cnt = 0;
+                } else
+                        fbn++;
+        }
+}
+
+// Called after a read that touched file blocks [first, last]. A read starting
+// where the previous one ended extends the read-ahead window, doubling its
+// size up to RAMAX blocks, whenever the reader gets within half a window of
+// its end; any other read closes the window. So does a read as large as the
+// window: it was already moved with as few requests as possible, and so will
+// the reads following it.
+static void readahead_update(struct inode *ip, uint32_t first, uint32_t last)
+{
+        uint32_t nblocks = (ip->d.size + fs->bsize - 1) / fs->bsize;
+        uint32_t from, to;
+        if ((first != ip->ralast && first != ip->ralast + 1) ||
+            last - first + 1 >= RAMAX) {
+                ip->ralast = last;
+                ip->rawin = ip->raend = 0;
+                return;
+        }
+        ip->ralast = last;
+        if (last + 1 + ip->rawin / 2 < ip->raend) return;
+        ip->rawin = ip->rawin ? ip->rawin * 2 : RAMIN;
+        if (ip->rawin > RAMAX) ip->rawin = RAMAX;
+        from = ip->raend > last + 1 ? ip->raend : last + 1;
+        to = last + 1 + ip->rawin;
+        if (to > nblocks) to = nblocks;
+        if (from < to) readahead(ip, from, to - from);
+        ip->raend = to;
+}
+
+static int irw(struct inode *ip, void *buf, int sz, uint32_t off, int w);
+
+// Move the data of inline file ip out of its inode to a data block, where it
+// can grow. Return -1, leaving the file as it was, if out of blocks.
+static int iunline(struct inode *ip)
+{
+        uint8_t data[INLINE_MAX];
+        memcpy(data, ip->d.ptrs, INLINE_MAX);
+        memset(ip->d.ptrs, 0, INLINE_MAX);
+        ip->d.type &= ~T_INLINE;
+        ip->dirty = 1;
+        if (!ip->d.size || irw(ip, data, ip->d.size, 0, 1) == ip->d.size)
+                return 0;
+        // Nothing could be allocated for the data.
+        memcpy(ip->d.ptrs, data, INLINE_MAX);
+        ip->d.type |= T_INLINE;
+        return -1;
+}
+
+// Return whether the data blocks of in-core inode ip hold metadata, which is
+// logged. The reference counts must agree with the inodes, so they're logged
+// like directories.
+static int imeta(struct inode *ip)
+{
+        return ITYPE(&ip->d) == T_DIR || ip->inum == fs->su.irefcount;
+}
+
+// Read or write 'sz' bytes at offset 'off' of in-core inode ip, which the
+// caller holds.
+static int irw(struct inode *ip, void *buf, int sz, uint32_t off, int w)
+{
+        struct dinode *di = &ip->d;
+        struct run r = {.w = w, .cnt = 0};
+        r.meta = imeta(ip);
+        char *p = buf;
+        uint32_t left;
+        if ((uint32_t)sz > (uint32_t)0xefffffff) {
+                fs->printf("inode_rw: %u: size out of bounds", sz);
+                return -1;
+        }
+        if (!w && off >= di->size) return 0;
+        if (!w && off + sz >= di->size) sz = di->size - off;
+        if (di->type & T_INLINE) {
+                // Whatever the size says, there's no more data than that.
+                if (!w && off + sz > INLINE_MAX)
+                        sz = off < INLINE_MAX ? INLINE_MAX - off : 0;
+                if (!w || off + sz <= INLINE_MAX) {
+                        // The data is in the inode itself.
+                        uint8_t *data = (uint8_t *)di->ptrs + off;
+                        if (w) {
+                                memcpy(data, buf, sz);
+                                if (off + sz > di->size) di->size = off + sz;
+                                ip->dirty = 1;
+                        } else
+                                memcpy(buf, data, sz);
+                        return sz;
+                }
+                if (iunline(ip) < 0) return 0;
+        }
+        for (left = sz; left;) {
+                uint32_t start = off % fs->bsize;
+                uint32_t n = left < fs->bsize - start ? left : fs->bsize - start;
+                uint32_t pbn = bmap(ip, off / fs->bsize,
+                                    w ? (n < fs->bsize ? BMAP_ZERO : 1) : 0, 0);
+                if (pbn && w)
+                        pbn = bunshare(ip, off / fs->bsize, pbn, n < fs->bsize);
+                if (pbn)
+                        run_add(&r, pbn, off, p, n);
+                else if (w)
+                        break; // Ran out of free blocks or hit the size limit
+                else
+                        memset(p, 0, n); // A hole in a sparse file
+                p += n;
+                off += n;
+                left -= n;
+        }
+        run_flush(&r);
+        if (!w && RAMAX && left != (uint32_t)sz)
+                readahead_update(ip, (off - (sz - left)) / fs->bsize,
+                                 (off - 1) / fs->bsize);
+        // Update the inode size in case it's a write operation that extended
+        // the file. bmap() has marked the inode dirty already if the write
+        // filled in any of its pointers.
+        if (off > di->size) {
+                di->size = off;
+                ip->dirty = 1;
+        }
+        return sz - left;
+}
+
+static int inode_rw(uint32_t inum, void *buf, int sz, uint32_t off, int w)
+{
+        struct inode *ip;
+        if (!fs->init) {
+                fs->printf("uninitialized\n", inum);
+                return -1;
+        }
+        if (!(ip = iget(inum))) return -1;
+        int n = irw(ip, buf, sz, off, w);
+        iput(ip);
+        return n;
+}
+
+// 'sz' is chosen to be of type 'int' since this filesystem is made for a 32-bit
+// system where you can have a maximum of 4GB physical memory. The largest
+// signed integer is 0xefffffff, which is half of that. Anyone sane, knowing
+// they're programming for a 32-bit system, should not create a 'buf' over that
+// size.
+int fs_write(struct fs_mount *m, uint32_t inum, void *buf, int sz,
+             uint32_t off)
+{
+        fs = m;
+        log_begin();
+        return inode_rw(inum, buf, sz, off, 1);
+}
+
+int fs_read(struct fs_mount *m, uint32_t inum, void *buf, int sz, uint32_t off)
+{
+        fs = m;
+        return inode_rw(inum, buf, sz, off, 0);
+}
+
+// Describe file 'inum' from offset 'off' on with up to 'n' extents in 'ext,'
+// each covering as many bytes as possible, the last one ending at the end of
+// the file if there are enough. Return the number of extents filled, 0 if
+// 'off' is past the end of the file, or -1 on error.
+int fs_fiemap(struct fs_mount *m, uint32_t inum, uint32_t off,
+              struct fs_extent *ext, int n)
+{
+        struct inode *ip;
+        struct fs_extent *e = ext - 1;
+        fs = m;
+        if (!fs->init) {
+                fs->printf("uninitialized\n");
+                return -1;
+        }
+        if (!(ip = iget(inum))) return -1;
+        uint32_t size = ip->d.size;
+        if (off < size && n && ip->d.type & T_INLINE) {
+                *++e = (struct fs_extent){off, size - off, 0, FS_EXTENT_INLINE};
+                off = size;
+        }
+        for (uint32_t fbn = off / fs->bsize; off < size; fbn++) {
+                uint32_t pbn = bmap(ip, fbn, 0, 0);
+                uint32_t end = (fbn + 1) * fs->bsize;
+                if (end > size) end = size;
+                // Does this block continue the last extent?
+                int more = e >= ext && !(e->flags & FS_EXTENT_INLINE);
+                if (more && pbn)
+                        more = e->block &&
+                               e->block + fbn - e->off / fs->bsize == pbn;
+                else if (more)
+                        more = !e->block;
+                if (more)
+                        e->len = end - e->off;
+                else if (e - ext + 1 == n)
+                        break;
+                else
+                        *++e = (struct fs_extent){off, end - off, pbn,
+                                                  pbn ? 0 : FS_EXTENT_HOLE};
+                off = end;
+        }
+        iput(ip);
+        return e - ext + 1;
+}
+
+// Truncation
+//
+// There are three types of blocks:
+//
+// 1. Data blocks
+// 2. Singly-indirect blocks
+// 3. Doubly-indirect blocks
+//
+// We consider all these blocks to be *indirect* blocks
+// and distinguish them by their "indirect level," ilevel for short.
+//
+// Below are the ilevels for each type of block:
+// Data blocks:             ilevel=0
+// Singly-indirect blocks:  ilevel=1
+// Doubly-indirect blocks:  ilevel=2
+
+// Free the blocks under pointer *pp, a pointer to a block of level 'ilevel'
+// covering the file blocks starting at 'base,' that map file blocks 'from'
+// and after. Indirect blocks left pointing nowhere go too: *pp is then
+// cleared and its block returned, for the caller to free once it has marked
+// its change, as this does for the pointers of the blocks below. Return 0 if
+// *pp stays.
+static uint32_t trunc_ptr(uint32_t *pp, int ilevel, uint32_t base,
+                          uint32_t from)
+{
+        uint32_t n = *pp;
+        if (!n) return 0;
+        if (ilevel) {
+                // Number of file blocks covered by each pointer of the block
+                uint32_t span = ilevel == 1 ? 1 : fs->nptrs;
+                int used = 0;
+                struct buf *b = bread(n);
+                uint32_t *ptrs = (uint32_t *)b->data;
+                for (int i = 0; i < fs->nptrs; i++) {
+                        uint32_t c;
+                        if (base + (i + 1) * span > from &&
+                            (c = trunc_ptr(&ptrs[i], ilevel - 1,
+                                           base + i * span, from))) {
+                                bwrite(b);
+                                bdrop(c);
+                        }
+                        used |= ptrs[i] != 0;
+                }
+                brelse(b);
+                if (used) return 0;
+        } else if (base < from)
+                return 0;
+        *pp = 0;
+        return n;
+}
+
+// Free the blocks of extent-mapped file ip from file block 'from' on, along
+// with its extent block if the extents left fit in the inode.
+static void etrunc(struct inode *ip, uint32_t from)
+{
+        struct buf *b = 0;
+        uint32_t base = 0;
+        uint32_t cnt = extent_count(ip, 0, &b);
+        for (uint32_t i = 0; i < cnt; i++)
+                base += extent_at(ip, i, &b)->len;
+        // From the last extent back, so that the extents left always map the
+        // start of the file, whenever the changes are committed.
+        for (uint32_t i = cnt; i-- > 0;) {
+                struct extent *e = extent_at(ip, i, &b);
+                uint32_t start = e->start, len = e->len;
+                base -= len;
+                if (from >= base + len) break;
+                uint32_t keep = from > base ? from - base : 0;
+                e->len = keep;
+                if (!keep) e->start = 0;
+                if (i < NIEXTENTS)
+                        ip->dirty = 1;
+                else
+                        bwrite(b);
+                if (start)
+                        for (uint32_t j = keep; j < len; j++)
+                                bdrop(start + j);
+        }
+        uint32_t n = EXTBLOCK(&ip->d);
+        int drop = n && !extent_at(ip, NIEXTENTS, &b)->len;
+        if (b) brelse(b);
+        if (drop) {
+                EXTBLOCK(&ip->d) = 0;
+                ip->dirty = 1;
+                bdrop(n);
+        }
+}
+
+// Set the size of in-core inode ip to 'size,' freeing the blocks past the new
+// end of the file. Return -1, leaving the file as it was, if an inline file
+// must move to a block and there's none left.
+static int itrunc(struct inode *ip, uint32_t size)
+{
+        uint32_t from = (size + fs->bsize - 1) / fs->bsize;
+        uint32_t base = 0, n;
+        uint32_t z = size < ip->d.size ? size : ip->d.size;
+        if (ip->d.type & T_INLINE && size > INLINE_MAX && iunline(ip) < 0)
+                return -1;
+        if (ip->d.type & T_INLINE) {
+                // Keep the bytes past the end zero, as the ones of a block.
+                memset((uint8_t *)ip->d.ptrs + z, 0, INLINE_MAX - z);
+                ip->dirty = 1;
+        } else if (ip->d.type & T_EXTENTS)
+                etrunc(ip, from);
+        else
+                for (int i = 0; i < NPTRS; i++) {
+                        int l = get_ilevel(i);
+                        uint32_t span = l == 0   ? 1
+                                        : l == 1 ? fs->nptrs
+                                                 : fs->nptrs * fs->nptrs;
+                        if (base + span > from &&
+                            (n = trunc_ptr(&ip->d.ptrs[i], l, base, from))) {
+                                ip->dirty = 1;
+                                bdrop(n);
+                        }
+                        base += span;
+                }
+        bfree_done();
+        prealloc_drop(ip->inum);
+        map_clear(ip);
+        ip->ralast = NOBLOCK;
+        ip->rawin = ip->raend = 0;
+        // Bytes past the old end of the file in its last block may be
+        // anything, and so may the ones past the new end, which are gone.
+        // Either would show through if the file grew again.
+        if (!(ip->d.type & T_INLINE) && z % fs->bsize) {
+                uint32_t pbn = bmap(ip, z / fs->bsize, 0, 0);
+                if (pbn) pbn = bunshare(ip, z / fs->bsize, pbn, 1);
+                if (pbn) {
+                        struct buf *b = bread(pbn);
+                        memset(b->data + z % fs->bsize, 0,
+                               fs->bsize - z % fs->bsize);
+                        if (imeta(ip))
+                                bwrite(b);
+                        else
+                                bwrite_data(b);
+                        brelse(b);
+                }
+        }
+        if (ip->d.size != size) {
+                ip->d.size = size;
+                ip->dirty = 1;
+        }
+        return 0;
+}
+
+// Set the size of regular file 'inum' to 'size.' Shrinking a file frees its
+// blocks past the new end, while growing it leaves a hole that reads as
+// zeros. Return -1, leaving the file as it was, on failure.
+int fs_truncate(struct fs_mount *m, uint32_t inum, uint32_t size)
+{
+        struct inode *ip;
+        fs = m;
+        log_begin();
+        if (!fs->init) {
+                fs->printf("uninitialized\n");
+                return -1;
+        }
+        if (!(ip = iget(inum))) return -1;
+        if (ITYPE(&ip->d) == T_DIR) {
+                fs->printf("fs_truncate: %u: Is a directory\n", inum);
+                iput(ip);
+                return -1;
+        }
+        int err = itrunc(ip, size);
+        iput(ip);
+        return err;
+}
+
+static void dirhash_set(struct dinode *di, uint32_t n);
+
+// Free all the blocks of in-core inode ip, including a directory's index.
+static void iempty(struct inode *ip)
+{
+        if (ITYPE(&ip->d) == T_DIR && DIRINDEX(&ip->d)) {
+                uint32_t index = DIRINDEX(&ip->d);
+                dirhash_set(&ip->d, 0);
+                ip->dirty = 1;
+                bfree(index);
+        }
+        itrunc(ip, 0);
+}
+
+// Free an inode. Also need to free all referenced data blocks.
+int free_inode(uint32_t n)
+{
+        struct inode *ip;
+        if (!fs->init) {
+                fs->printf("uninitialized\n");
+                return -1;
+        }
+        if (!(ip = iget(n))) return -1;
+        iempty(ip);
+        ip->d.type = 0;
+        ip->dirty = 1;
+        iput(ip);
+        return 0;
+}
+
+// Directory hash index
+//
+// With FEAT_DIRHASH, a directory gets a one-block hash index (struct dirhash)
+// mapping names to the position of their entries, so a lookup reads the index
+// and a single entry instead of scanning the whole directory. Directories
+// with more entries than DIRHASH_MAX have no index and are scanned.
+
+// Keep the hash table at most 3/4 full so probe sequences stay short.
+#define DIRHASH_MAX (fs->ndirhash * 3 / 4)
+// Entry count of an index left stale on purpose, which no directory has
+#define DIRHASH_STALE 0xffffffff
+
+// FNV-1a
+static uint32_t dirhash_name(char *name)
 {
-        return rw_inode(inum, p, 0);
+        uint32_t h = 2166136261u;
+        for (int i = 0; i < MAXNAME && name[i]; i++)
+                h = (h ^ (uint8_t)name[i]) * 16777619u;
+        return h;
 }
 
-static int write_inode(uint32_t inum, struct dinode *p)
+static void dirhash_set(struct dinode *di, uint32_t n)
 {
-        return rw_inode(inum, p, 1);
+        di->major = n & 0xffff;
+        di->minor = n >> 16;
 }
 
-int fs_geti(uint32_t inum, struct dinode *p) { return read_inode(inum, p); }
-
-// Given a index into the 'ptrs' array in an inode,
-// this function returns the indirection level of the
-// pointer entry - if it's a direct, singly-indirect,
-// or a doubly-indirect pointer.
-static int get_ilevel(int ptr_idx)
+static void dirhash_insert(struct dirhash *dh, char *name, uint32_t i)
 {
-        if (ptr_idx < NDIRECT)
-                return 0;
-        else if (ptr_idx < NDIRECT + NINDRECT)
-                return 1;
-        else
-                return 2;
+        uint32_t h = dirhash_name(name) % fs->ndirhash;
+        for (; dh->slots[h] && dh->slots[h] != DIRHASH_DELETED;
+             h = (h + 1) % fs->ndirhash)
+                ;
+        dh->slots[h] = i + 1;
 }
 
-// There are three types of blocks:
-//
-// 1. Data blocks
-// 2. Singly-indirect blocks
-// 3. Doubly-indirect blocks
-//
-// We consider all these blocks to be *indirect* blocks
-// and distinguish them by their "indirect level," ilevel for short.
-//
-// Below are the ilevels for each type of block:
-// Data blocks:             ilevel=0
-// Singly-indirect blocks:  ilevel=1
-// Doubly-indirect blocks:  ilevel=2
-
-// Frees a general indirect block (can be a data block if ilevel=0). Recursively
-// frees all sub-level blocks based on the ilevel value. For example, an initial
-// call with ilevel=2 for a doubly-indirect block will recursively free all
-// singly-indirect blocks and their respective data blocks.
-static int free_indirect(uint32_t n, int ilevel)
+// Rebuild the index of directory 'inum' from its entries.
+static void dirhash_build(uint32_t inum, struct dinode *di, struct buf *b)
 {
-        // ilevel=0 is the base case: it is a data block
-        if (!ilevel) {
-                assert(bitmap_free(n));
-                return 0;
+        struct dirhash *dh = (struct dirhash *)b->data;
+        memset(b->data, 0, fs->bsize);
+        dh->nentries = di->size / sizeof(struct dirent);
+        for (uint32_t i = 0; i < dh->nentries; i++) {
+                struct dirent de;
+                assert(inode_rw(inum, &de, sizeof de, i * sizeof de, 0) ==
+                       sizeof de);
+                if (de.inum) dirhash_insert(dh, de.name, i);
         }
-        // Not a data block. Then it must be an indirect block.
-        // We treat doubly-indirect and singly-indirect blocks
-        // the same since they are all just a block of pointers.
-        union block b;
-        // Read the indirect block
-        fs.disk_read(n, &b);
-        // Free the block after reading into memory
-        assert(!bitmap_free(n));
-        // Recursively free all referenced sub-level blocks
-        for (int i = 0; i < NPTRS_PER_BLOCK; i++)
-                if (b.ptrs[i])
-                        free_indirect(b.ptrs[i],
-                                      ilevel -
-                                          1); // Decrement ilevel per recursion
-        return 0;
+        b->valid = 1;
+        bwrite(b);
 }
 
-// Free an inode. Also need to free all referenced data blocks.
-int free_inode(uint32_t n)
+// Rebuild the index of directory 'inum' from scratch, creating or
+// dropping the index as its size calls for.
+static void dirhash_reindex(uint32_t inum)
 {
-        union block b;
         struct dinode di;
-        if (!fs.init) {
-                fs.printf("uninitialized\n");
-                return -1;
+        uint32_t n;
+        if (!(fs->su.features & FEAT_DIRHASH)) return;
+        assert(read_inode(inum, &di) >= 0);
+        if (di.type & T_INLINE) return;
+        n = DIRINDEX(&di);
+        if (di.size / sizeof(struct dirent) > DIRHASH_MAX) {
+                if (n) {
+                        dirhash_set(&di, 0);
+                        write_inode(inum, &di);
+                        bfree(n);
+                        bfree_done();
+                }
+                return;
         }
-        if (read_inode(n, &di) < 0) return -1;
-        di.type = 0;
-        for (int i = 0; i < NPTRS; i++)
-                if (di.ptrs[i]) free_indirect(di.ptrs[i], get_ilevel(i));
-        write_inode(n, &di);
-        return 0;
+        if (!n) {
+                if (!(n = balloc(inum, 0))) return;
+                dirhash_set(&di, n);
+                write_inode(inum, &di);
+        }
+        struct buf *b = bget(n);
+        dirhash_build(inum, &di, b);
+        brelse(b);
 }
 
-uint32_t alloc_inode(uint16_t type)
+// Record that entry 'i' of directory 'inum' is now 'name.' Creates the index
+// if the directory doesn't have one yet, and drops it if the directory has
+// grown too large for it.
+static void dirhash_add(uint32_t inum, char *name, uint32_t i)
 {
-        // Invalid inode type, return error
-        if (type > T_DEV) {
-                fs.printf("alloc_inode: %d: Invalid type\n", type);
-                return NULLINUM;
+        struct dinode di;
+        uint32_t n;
+        if (!(fs->su.features & FEAT_DIRHASH)) return;
+        assert(read_inode(inum, &di) >= 0);
+        // An inline directory is small enough to scan.
+        if (di.type & T_INLINE) return;
+        uint32_t cnt = di.size / sizeof(struct dirent);
+        if (!(n = DIRINDEX(&di)) || cnt > DIRHASH_MAX) {
+                dirhash_reindex(inum);
+                return;
         }
-        // Loop through all blocks for inode
-        for (int i = 0; i < fs.su.nblock_inode; i++) {
-                union block b;
-                // Read current inode block to the buffer
-                fs.disk_read(i + fs.su.sinode, &b);
-                for (int j = 0; j < NINODES_PER_BLOCK; j++) {
-                        // Found a unallocated inode
-                        if (!b.inodes[j].type) {
-                                struct dinode *p = &b.inodes[j];
-                                memset(p, 0, sizeof(*p));
-                                p->type = type;
-                                // Write back updated inode block
-                                fs.disk_write(i + fs.su.sinode, &b);
-                                return i * NINODES_PER_BLOCK + j;
+        struct buf *b = bread(n);
+        struct dirhash *dh = (struct dirhash *)b->data;
+        if (dh->nentries == cnt && i < cnt) {
+                // Reused a free entry
+                dirhash_insert(dh, name, i);
+                bwrite(b);
+        } else if (dh->nentries == i && i + 1 == cnt) {
+                // Appended an entry
+                dirhash_insert(dh, name, i);
+                dh->nentries++;
+                bwrite(b);
+        } else
+                dirhash_build(inum, &di, b);
+        brelse(b);
+}
+
+// Record that entry 'i' of directory 'inum,' which was 'name,' is now free.
+static void dirhash_remove(uint32_t inum, char *name, uint32_t i)
+{
+        struct dinode di;
+        uint32_t n;
+        if (!(fs->su.features & FEAT_DIRHASH)) return;
+        assert(read_inode(inum, &di) >= 0);
+        if (!(n = DIRINDEX(&di))) return;
+        struct buf *b = bread(n);
+        struct dirhash *dh = (struct dirhash *)b->data;
+        // A stale index is rebuilt by the next dirhash_add() anyway.
+        if (dh->nentries == di.size / sizeof(struct dirent)) {
+                uint32_t h = dirhash_name(name) % fs->ndirhash;
+                for (int probe = 0; probe < fs->ndirhash && dh->slots[h];
+                     probe++, h = (h + 1) % fs->ndirhash)
+                        if (dh->slots[h] == i + 1) {
+                                dh->slots[h] = DIRHASH_DELETED;
+                                bwrite(b);
+                                break;
                         }
-                }
         }
-        fs.printf("alloc_inode: Out of inodes\n");
-        return NULLINUM;
+        brelse(b);
 }
 
-// This is the last argument of recursive_rw(), and the struct
-// members are shared among all recursive calls simultaneously.
-// This reduces the number of arguments to be passed and makes
-// the code more concise and readable. The struct contains elements
-// that have only one global copy across all instances of recursive_rw(),
-// generated from a single call to inode_rw(), while each recursive_rw()
-// call has their own private copies of the other two arguments.
-struct share_arg {
-        uint32_t boff;   // Current block offset within a file
-        uint32_t sblock; // Start block
-        uint32_t eblock; // End block
-        // Note: For each block pointed to by pp, we test if the data block it
-        // covers or itself if it is a data block (*boff + nblocks linked to it)
-        // overlaps with the [sblock, eblock] interval, and we skip this block
-        // if not.
-        uint32_t off;  // Same off in inode_rw()
-        char *buf;     // Same buf in inode_rw()
-        uint32_t left; // Number of bytes left
-        int w;         // Recursive write? Recursive read if 0
-};
+// Mark the index of directory di stale, so that lookups scan the directory
+// until the index is rebuilt.
+static void dirhash_stale(struct dinode *di)
+{
+        uint32_t n = DIRINDEX(di);
+        if (!(fs->su.features & FEAT_DIRHASH) || !n) return;
+        struct buf *b = bread(n);
+        ((struct dirhash *)b->data)->nentries = DIRHASH_STALE;
+        bwrite(b);
+        brelse(b);
+}
 
-static int recursive_rw(
-    uint32_t *pp, // Pointer to a block pointer (which could be in an inode or
-                  // an indirect pointer that caller traverses)
-    uint32_t ilevel, // Recursion level. 0 means we've reached a data block.
-    struct share_arg *sa)
-{
-        // Do we skip this indirect block?
-        // Compute data *block coverage* of this indirect (or data) block:
-        // [sblock, eblock)
-        uint32_t sblock = sa->boff;
-        uint32_t eblock = sa->boff;
-        if (ilevel == 0) eblock += 1;
-        if (ilevel == 1) eblock += NPTRS_PER_BLOCK;
-        if (ilevel == 2) eblock += NPTRS_PER_BLOCK * NPTRS_PER_BLOCK;
-        // Do [sblock, eblock) and [sa->sblock, sa->eblock], the *block
-        // coverage* of this w/r operation overlap?
-        if (!(sblock <= sa->eblock && sa->sblock < eblock)) {
-                sa->boff = eblock;
-                sa->off += (eblock - sblock) * BLOCKSIZE;
-                return 0;
+// Look up 'name' in the index of directory 'inum.' Return 1 and the entry
+// in *de and its position in *pi if found, 0 if the name isn't there, or -1
+// if there's no up-to-date index to tell.
+static int dirhash_lookup(uint32_t inum, struct dinode *di, char *name,
+                          struct dirent *de, uint32_t *pi)
+{
+        uint32_t n = DIRINDEX(di);
+        int found = 0;
+        if (!(fs->su.features & FEAT_DIRHASH) || !n) return -1;
+        struct buf *b = bread(n);
+        struct dirhash *dh = (struct dirhash *)b->data;
+        if (dh->nentries != di->size / sizeof(struct dirent)) {
+                brelse(b);
+                return -1;
         }
-        if (sa->w) {
-                // This indirect (or data) block is involved in this w/r,
-                // so it should not be null and we should allocate it if null.
-                int zero = 0;
-                if (!*pp && ilevel) zero = 1;
-                if (!*pp && !(*pp = bitmap_alloc()))
-                        return -1; // ran out of free blocks
-                if (zero) {
-                        char zeros[BLOCKSIZE] = {0};
-                        fs.disk_write(*pp, &zeros);
+        uint32_t h = dirhash_name(name) % fs->ndirhash;
+        for (int probe = 0; probe < fs->ndirhash && dh->slots[h];
+             probe++, h = (h + 1) % fs->ndirhash) {
+                if (dh->slots[h] == DIRHASH_DELETED) continue;
+                uint32_t i = dh->slots[h] - 1;
+                assert(inode_rw(inum, de, sizeof *de, i * sizeof *de, 0) ==
+                       sizeof *de);
+                if (de->inum && !strcmp(name, de->name)) {
+                        *pi = i;
+                        found = 1;
+                        break;
                 }
-        } else {
-                // Handle reading sparse files
-                if (!*pp) {
-                        int sz = (eblock - sblock) * BLOCKSIZE;
-                        if (sa->left < sz) sz = sa->left;
-                        memset(sa->buf, 0, sz);
-                        sa->buf += sz;
-                        sa->left -= sz;
-                        sa->off += sz;
-                        sa->boff = eblock;
-                        return 0;
-                }
-        }
-        union block b;
-        // It is an indirect block, start recursion.
-        if (ilevel) {
-                fs.disk_read(*pp, &b);
-                for (int i = 0; i < NPTRS_PER_BLOCK; i++)
-                        if (recursive_rw(&b.ptrs[i], ilevel - 1, sa)) {
-                                // If a write failed half way, we do *not* roll
-                                // back, but leave the blocks already written
-                                // and abort. However, we DO need to update the
-                                // indirect block that has been modified. That's
-                                // why we're writing back to disk this indirect
-                                // block.
-                                if (sa->w) fs.disk_write(*pp, &b);
-                                return -1;
-                        }
-                fs.disk_write(*pp, &b);
-                return 0;
         }
-        // It's a data block.
-        uint32_t start = sa->off % BLOCKSIZE;
-        int sz =
-            sa->left < (BLOCKSIZE - start) ? sa->left : (BLOCKSIZE - start);
-        fs.disk_read(*pp, &b);
-        if (sa->w) {
-                memcpy(&b.bytes[start], sa->buf, sz);
-                fs.disk_write(*pp, &b);
-        } else
-                memcpy(sa->buf, &b.bytes[start], sz);
-        sa->buf += sz;
-        sa->left -= sz;
-        sa->off += sz;
-        sa->boff = eblock; // Must update boff.
-        return 0;
+        brelse(b);
+        return found;
 }
 
-static int inode_rw(uint32_t inum, void *buf, int sz, uint32_t off, int w)
+// Name cache
+//
+// The results of recent name lookups, names found or not, are kept in a small
+// table so that resolving the same paths again doesn't read the directories
+// on the way. Each name may be in either entry of a pair, the most recently
+// used one first. Directories only change through fs_mknod() and
+// fs_unlink(), which record the name they add or remove. A directory is
+// empty when it's removed, so the names cached under its inum all record
+// misses and hold for whatever file reuses the inode.
+
+static struct name *ncache_pair(uint32_t dir, char *name)
 {
-        struct dinode di;
-        uint32_t sbyte = off;
-        uint32_t ebyte = off + sz;
-        if (!fs.init) {
-                fs.printf("uninitialized\n", inum);
-                return -1;
-        }
-        if ((uint32_t)sz > (uint32_t)0xefffffff) {
-                fs.printf("inode_rw: %u: size out of bounds", sz);
-                return -1;
-        }
-        // Read inode structure
-        if (read_inode(inum, &di) < 0) return -1;
-        if (!w && sbyte >= di.size) return 0;
-        if (!w && ebyte >= di.size) {
-                ebyte = di.size;
-                sz = di.size - sbyte;
-        }
-        uint32_t sblock = sbyte / BLOCKSIZE;
-        uint32_t eblock = ebyte / BLOCKSIZE;
-        struct share_arg *sa = &(struct share_arg){.boff = 0,
-                                                   .sblock = sblock,
-                                                   .eblock = eblock,
-                                                   .off = off,
-                                                   .buf = buf,
-                                                   .left = sz,
-                                                   .w = w};
-
-        for (int i = 0; i < NPTRS; i++)
-                if (recursive_rw(&di.ptrs[i], get_ilevel(i), sa)) break;
-        uint32_t consumed = sz - sa->left;
-        ebyte = off + consumed; // ebyte should remain unchanged if consumed
-                                // equals sz, indicating that the required
-                                // amount of bytes has been successfully
-                                // consumed from buf (write) or from disk (read)
-        di.size =
-            di.size > ebyte
-                ? di.size
-                : ebyte; // update inode size in case it's a write operation
-        if (w) assert(!write_inode(inum, &di)); // update inode
-        return consumed;
+        return &fs->ncache[(dirhash_name(name) + dir) % (FS_NNAME / 2) * 2];
 }
 
-// 'sz' is chosen to be of type 'int' since this filesystem is made for a 32-bit
-// system where you can have a maximum of 4GB physical memory. The largest
-// signed integer is 0xefffffff, which is half of that. Anyone sane, knowing
-// they're programming for a 32-bit system, should not create a 'buf' over that
-// size.
-int fs_write(uint32_t inum, void *buf, int sz, uint32_t off)
+// Return the cached result of looking up 'name' in 'dir,' moved to the front
+// of its pair, or 0.
+static struct name *ncache_get(uint32_t dir, char *name)
 {
-        return inode_rw(inum, buf, sz, off, 1);
+        struct name *c = ncache_pair(dir, name);
+        for (int i = 0; i < 2; i++)
+                if (c[i].dir == dir && !strncmp(c[i].name, name, MAXNAME)) {
+                        if (i) {
+                                struct name t = c[0];
+                                c[0] = c[1];
+                                c[1] = t;
+                        }
+                        return c;
+                }
+        return 0;
 }
 
-int fs_read(uint32_t inum, void *buf, int sz, uint32_t off)
+static void ncache_set(uint32_t dir, char *name, uint32_t inum)
 {
-        return inode_rw(inum, buf, sz, off, 0);
+        struct name *c = ncache_get(dir, name);
+        if (!c) {
+                // Evict the least recently used entry of the pair.
+                c = ncache_pair(dir, name);
+                c[1] = c[0];
+                c->dir = dir;
+                strncpy(c->name, name, MAXNAME);
+        }
+        c->inum = inum;
 }
 
 // Look up 'name' under the directory pointed to by 'inum.'
@@ -375,51 +2410,169 @@ int fs_read(uint32_t inum, void *buf, int sz, uint32_t off)
 static uint32_t dir_lookup(uint32_t inum, char *name, uint32_t *poff)
 {
         struct dinode di;
+        struct dirent de;
+        uint32_t i, r = NULLINUM;
+        // The cache doesn't know where entries are.
+        if (!poff) {
+                struct name *c = ncache_get(inum, name);
+                if (c) {
+                        fs->stats.nnamehit++;
+                        return c->inum;
+                }
+                fs->stats.nnamemiss++;
+        }
         assert(read_inode(inum, &di) >= 0);
         // Not a directory
-        if (di.type != T_DIR) return NULLINUM;
-        uint32_t off = 0;
-        for (int i = 0; i < di.size / sizeof(struct dirent);
-             i++, off += sizeof(struct dirent)) {
-                struct dirent de;
-                assert(fs_read(inum, &de, sizeof de, off) == sizeof de);
-                if (!strcmp(name, de.name)) {
-                        if (poff) *poff = off;
-                        return de.inum;
+        if (ITYPE(&di) != T_DIR) return NULLINUM;
+        switch (dirhash_lookup(inum, &di, name, &de, &i)) {
+        case 1:
+                if (poff) *poff = i * sizeof de;
+                r = de.inum;
+                break;
+        case -1:
+                for (i = 0; i < di.size / sizeof de; i++) {
+                        assert(inode_rw(inum, &de, sizeof de, i * sizeof de,
+                                        0) == sizeof de);
+                        if (de.inum && !strcmp(name, de.name)) {
+                                if (poff) *poff = i * sizeof de;
+                                r = de.inum;
+                                break;
+                        }
                 }
         }
-        return NULLINUM;
+        ncache_set(inum, name, r);
+        return r;
+}
+
+// Return the position of the first free entry of directory 'inum,' or the
+// number of entries if all are in use. With 'live,' return the position of
+// the first entry in use instead.
+static uint32_t dir_scan(uint32_t inum, struct dinode *di, int live)
+{
+        struct dirent des[BLOCKSIZE / sizeof(struct dirent)];
+        uint32_t cnt = di->size / sizeof(struct dirent);
+        uint32_t i = 0;
+        while (i < cnt) {
+                int n = inode_rw(inum, des, sizeof des, i * sizeof des[0], 0);
+                assert(n > 0);
+                for (int j = 0; j < n / sizeof des[0]; j++, i++)
+                        if (!des[j].inum == !live) return i;
+        }
+        return cnt;
 }
 
-// Find the inode corresponds to the given path.
-uint32_t fs_lookup(char *path)
+// Find the inode 'path' leads to from directory 'inum,' or from the root if
+// 'path' starts with '/'.
+static uint32_t lookupat(uint32_t inum, char *path)
 {
         if (!path) return NULLINUM;
         int l = strnlen(path, MAXPATH);
         if (l > MAXPATH - 1) return NULLINUM;
-        // This function only start finding from root
-        // restricting path must be preceeded by '/'
-        if (path[0] != '/') return NULLINUM;
-        uint32_t inum = ROOTINUM; // start from root
-        path += 1;                // skip the leading slash
+        if (path[0] == '/') inum = ROOTINUM;
         for (;;) {
+                // skip slashes
+                for (; *path == '/'; path++)
+                        ;
                 if (!*path) break;
-                // copy the next name from path
+                // copy the next name from path, leaving room for the null
                 char name[MAXNAME];
                 for (l = 0; *path && *path != '/'; l++, path++) {
-                        if (l >= MAXNAME) return NULLINUM;
+                        if (l >= MAXNAME - 1) return NULLINUM;
                         name[l] = *path;
                 }
-                // null-term the name
                 name[l] = 0;
-                // skip following slashes
-                for (; *path && *path == '/'; path++)
-                        ;
                 if (!(inum = dir_lookup(inum, name, 0))) return NULLINUM;
         }
         return inum;
 }
 
+// Find the inode corresponds to the given path, which must start with '/'.
+static uint32_t lookup(char *path)
+{
+        if (!path || path[0] != '/') return NULLINUM;
+        return lookupat(ROOTINUM, path);
+}
+
+uint32_t fs_lookup(struct fs_mount *m, char *path)
+{
+        fs = m;
+        return lookup(path);
+}
+
+// Find the inode 'path' leads to from directory 'dir,' e.g., "boot/kernel"
+// from the inum of "/". An absolute path starts from the root all the same.
+uint32_t fs_lookupat(struct fs_mount *m, uint32_t dir, char *path)
+{
+        struct dinode di;
+        fs = m;
+        if (read_inode(dir, &di) < 0 || ITYPE(&di) != T_DIR) return NULLINUM;
+        return lookupat(dir, path);
+}
+
+// Start listing directory 'inum' from its first entry.
+int fs_opendir(struct fs_mount *m, uint32_t inum, struct fs_dir *dir,
+               int flags)
+{
+        struct dinode di;
+        fs = m;
+        if (read_inode(inum, &di) < 0) return -1;
+        if (ITYPE(&di) != T_DIR) {
+                fs->printf("fs_opendir: %u: Not a directory\n", inum);
+                return -1;
+        }
+        dir->inum = inum;
+        dir->off = 0;
+        dir->flags = flags;
+        return 0;
+}
+
+// Read the inode blocks of the 'cnt' entries of 'des' into the cache, in
+// ascending order, with a request per run of consecutive blocks.
+static void iprefetch(struct dirent *des, int cnt)
+{
+        uint32_t start = 0, len = 0, next = 0;
+        for (;;) {
+                // The lowest inode block from 'next' on
+                uint32_t b = NOBLOCK;
+                for (int i = 0; i < cnt; i++) {
+                        uint32_t x = iblock(des[i].inum);
+                        if (x >= next && x < b) b = x;
+                }
+                if (len && (b != start + len || len == fs->maxrun)) {
+                        bprefetch(start, len);
+                        len = 0;
+                }
+                if (b == NOBLOCK) break;
+                if (!len++) start = b;
+                next = b + 1;
+        }
+}
+
+// Fill 'des' with up to 'n' entries in use of directory 'dir,' the ones left
+// in the block holding its next entry, or in the blocks after it if that one
+// has none. Return the number of entries, 0 at the end of the directory or
+// -1 on failure. With FS_DIR_STAT, the inode blocks of the entries are read
+// into the cache, a run of consecutive ones per request, so that the caller
+// can fs_geti() them without going to the disk one inode block at a time.
+int fs_readdir(struct fs_mount *m, struct fs_dir *dir, struct dirent *des,
+               int n)
+{
+        int cnt = 0;
+        fs = m;
+        if (n <= 0) return -1;
+        while (!cnt) {
+                uint32_t left = fs->bsize - dir->off % fs->bsize;
+                if (left > n * sizeof *des) left = n * sizeof *des;
+                int sz = inode_rw(dir->inum, des, left, dir->off, 0);
+                if (sz <= 0) return sz;
+                dir->off += sz;
+                for (int i = 0; i < sz / sizeof *des; i++)
+                        if (des[i].inum) des[cnt++] = des[i];
+        }
+        if (dir->flags & FS_DIR_STAT) iprefetch(des, cnt);
+        return cnt;
+}
+
 // Every path can be seen as parent/name
 static char *getname(char *path, char *name, char *parent)
 {
@@ -445,7 +2598,7 @@ static char *getname(char *path, char *name, char *parent)
 }
 
 // Create an inode pointed to by path
-uint32_t fs_mknod(char *path, uint16_t type)
+static uint32_t mknod(char *path, uint16_t type)
 {
         uint32_t n;
         char parent[MAXPATH];
@@ -453,36 +2606,42 @@ uint32_t fs_mknod(char *path, uint16_t type)
         struct dinode di;
         struct dirent de;
         if (!getname(path, name, parent)) {
-                fs.printf("fs_mknod: %s: Invalid path\n");
+                fs->printf("fs_mknod: %s: Invalid path\n", path);
                 return NULLINUM;
         }
         // Parent path must points to a valid *directory* inode.
-        n = fs_lookup(parent);
+        n = lookup(parent);
         if (n == NULLINUM) {
-                fs.printf("fs_mknod: %s: No such file or directory\n", parent);
+                fs->printf("fs_mknod: %s: No such file or directory\n", parent);
                 return NULLINUM;
         }
         // inums stored in directory entries are supposedly valid
         assert(read_inode(n, &di) >= 0);
-        if (di.type != T_DIR) {
-                fs.printf("fs_mknod: %s: Not a directory\n", parent);
+        if (ITYPE(&di) != T_DIR) {
+                fs->printf("fs_mknod: %s: Not a directory\n", parent);
                 return NULLINUM;
         }
         // Check for duplicates
         if (dir_lookup(n, name, 0)) {
-                fs.printf("fs_mknod: %s: file exists\n", name);
+                fs->printf("fs_mknod: %s: file exists\n", name);
                 return NULLINUM;
         }
         // Create an inode.
-        de.inum = alloc_inode(type);
+        if (fs->su.features & FEAT_INLINE &&
+            ((type & 0xff) == T_REG || (type & 0xff) == T_DIR))
+                type |= T_INLINE;
+        de.inum = alloc_inode(type, n);
         if (de.inum == NULLINUM) return NULLINUM;
-        // Link it to the "parent" dir.
+        // Link it to the "parent" dir, in the first free entry if any.
         strncpy(de.name, name, MAXNAME);
-        if (fs_write(n, &de, sizeof de, di.size) != sizeof de) {
+        uint32_t i = dir_scan(n, &di, 0);
+        if (inode_rw(n, &de, sizeof de, i * sizeof de, 1) != sizeof de) {
                 free_inode(de.inum);
-                fs.printf("fs_mknod: %s: dir write failed\n", parent);
+                fs->printf("fs_mknod: %s: dir write failed\n", parent);
                 return NULLINUM;
         }
+        dirhash_add(n, name, i);
+        ncache_set(n, name, de.inum);
         // Inc link count to 1 cus now "parent" dir points to it.
         read_inode(de.inum, &di);
         di.linkcnt++;
@@ -490,48 +2649,558 @@ uint32_t fs_mknod(char *path, uint16_t type)
         return de.inum;
 }
 
-int fs_init(struct partition *p, diskfunc rfunc, diskfunc wfunc,
-            printfunc pfunc)
+uint32_t fs_mknod(struct fs_mount *m, char *path, uint16_t type)
+{
+        fs = m;
+        log_begin();
+        return mknod(path, type);
+}
+
+// Remove the directory entry pointed to by path and free its inode once no
+// entry points to it. The entry is left free for fs_mknod() to reuse.
+// Directories must be empty to be removed.
+static int unlink(char *path)
+{
+        uint32_t dir, inum, off;
+        char parent[MAXPATH];
+        char name[MAXNAME];
+        struct dinode di;
+        struct dirent de;
+        if (!getname(path, name, parent)) {
+                fs->printf("fs_unlink: %s: Invalid path\n", path);
+                return -1;
+        }
+        dir = lookup(parent);
+        if (dir == NULLINUM || !(inum = dir_lookup(dir, name, &off))) {
+                fs->printf("fs_unlink: %s: No such file or directory\n", path);
+                return -1;
+        }
+        // Only open files hold inodes between calls.
+        struct inode *ip = ilookup(inum);
+        if (ip && ip->ref) {
+                fs->printf("fs_unlink: %s: File is open\n", path);
+                return -1;
+        }
+        assert(read_inode(inum, &di) >= 0);
+        if (ITYPE(&di) == T_DIR &&
+            dir_scan(inum, &di, 1) < di.size / sizeof de) {
+                fs->printf("fs_unlink: %s: Directory not empty\n", path);
+                return -1;
+        }
+        // Free the blocks of a file going away while it's still in its
+        // directory, so that a commit in the middle of that leaves it there,
+        // only shorter, rather than out of the tree.
+        if (di.linkcnt <= 1) {
+                if (!(ip = iget(inum))) return -1;
+                iempty(ip);
+                iput(ip);
+        }
+        memset(&de, 0, sizeof de);
+        if (inode_rw(dir, &de, sizeof de, off, 1) != sizeof de) {
+                fs->printf("fs_unlink: %s: dir write failed\n", parent);
+                return -1;
+        }
+        dirhash_remove(dir, name, off / sizeof de);
+        ncache_set(dir, name, NULLINUM);
+        if (di.linkcnt > 1) {
+                di.linkcnt--;
+                write_inode(inum, &di);
+                return 0;
+        }
+        return free_inode(inum);
+}
+
+int fs_unlink(struct fs_mount *m, char *path)
+{
+        fs = m;
+        log_begin();
+        return unlink(path);
+}
+
+// Return a copy of metadata block n for inode 'inum,' or 0 if out of blocks.
+static struct buf *bdup(uint32_t n, uint32_t inum)
+{
+        uint32_t new = balloc(inum, 0);
+        if (!new) return 0;
+        struct buf *from = bread(n);
+        struct buf *to = bget(new);
+        memcpy(to->data, from->data, fs->bsize);
+        to->valid = 1;
+        brelse(from);
+        return to;
+}
+
+// Make pointer *pp, to a block of level 'ilevel' of a file being cloned, a
+// pointer of clone ip: indirect blocks are copied, and data blocks get one
+// more reference. On failure, pointers left without a reference or a copy are
+// cleared, and -1 is returned. Allocations may commit and write ip back, so
+// it's marked dirty again after *pp changes, as *pp may be in ip->d.
+static int clone_ptr(struct inode *ip, uint32_t *pp, int ilevel)
+{
+        struct buf *b;
+        int err = 0;
+        if (!*pp) return 0;
+        if (!ilevel) {
+                if (refcount_add(*pp, 1) == 0) return 0;
+                *pp = 0;
+                ip->dirty = 1;
+                return -1;
+        }
+        if (!(b = bdup(*pp, ip->inum))) {
+                *pp = 0;
+                ip->dirty = 1;
+                return -1;
+        }
+        uint32_t *ptrs = (uint32_t *)b->data;
+        for (int i = 0; i < fs->nptrs; i++)
+                if (err)
+                        ptrs[i] = 0;
+                else
+                        err = clone_ptr(ip, &ptrs[i], ilevel - 1);
+        *pp = b->blockno;
+        ip->dirty = 1;
+        bwrite(b);
+        brelse(b);
+        return err;
+}
+
+// Make the extents of extent-mapped file ip, just copied from the file being
+// cloned, its own. On failure, extents left without references are cleared,
+// and -1 is returned. As in clone_ptr(), ip is marked dirty again after each
+// change.
+static int clone_extents(struct inode *ip)
+{
+        struct buf *b = 0;
+        int err = 0;
+        if (EXTBLOCK(&ip->d)) {
+                if (!(b = bdup(EXTBLOCK(&ip->d), ip->inum))) {
+                        memset(ip->d.ptrs, 0, sizeof ip->d.ptrs);
+                        ip->dirty = 1;
+                        return -1;
+                }
+                EXTBLOCK(&ip->d) = b->blockno;
+                ip->dirty = 1;
+        }
+        uint32_t cnt = extent_count(ip, 0, &b);
+        for (uint32_t i = 0; i < cnt; i++) {
+                struct extent *e = extent_at(ip, i, &b);
+                uint32_t j = 0;
+                if (!err && e->start)
+                        for (; j < e->len; j++)
+                                if ((err = refcount_add(e->start + j, 1)))
+                                        break;
+                if (!err) continue;
+                // Keep the blocks that got a reference.
+                e->len = j;
+                if (!j) e->start = 0;
+                ip->dirty = 1;
+        }
+        if (b) {
+                bwrite(b);
+                brelse(b);
+        }
+        return err;
+}
+
+// Create regular file 'path' sharing the data blocks of file 'src,' which
+// either file gets its own copy of once it writes to them. Return the inode
+// number of the new file, or NULLINUM on failure.
+uint32_t fs_clone(struct fs_mount *m, uint32_t src, char *path)
+{
+        struct inode *sp, *ip;
+        struct dinode di;
+        uint32_t inum;
+        int err = 0;
+        fs = m;
+        log_begin();
+        if (!fs->init) {
+                fs->printf("uninitialized\n");
+                return NULLINUM;
+        }
+        if (read_inode(src, &di) < 0) return NULLINUM;
+        if (ITYPE(&di) != T_REG || src == fs->su.irefcount) {
+                fs->printf("fs_clone: %u: Not a regular file\n", src);
+                return NULLINUM;
+        }
+        // The first clone creates the reference count file.
+        if (!(fs->su.features & FEAT_REFLINK)) {
+                uint32_t r = alloc_inode(T_REG, NULLINUM);
+                if (r == NULLINUM) return NULLINUM;
+                read_inode(r, &di);
+                di.linkcnt = 1;
+                write_inode(r, &di);
+                fs->su.irefcount = r;
+                fs->su.features |= FEAT_REFLINK;
+                struct buf *b = bread(fs->su.start);
+                *(struct superblock *)b->data = fs->su;
+                bwrite(b);
+                brelse(b);
+        }
+        if ((inum = mknod(path, T_REG)) == NULLINUM) return NULLINUM;
+        assert(sp = iget(src));
+        assert(ip = iget(inum));
+        uint16_t linkcnt = ip->d.linkcnt;
+        ip->d = sp->d;
+        ip->d.linkcnt = linkcnt;
+        ip->dirty = 1;
+        iput(sp);
+        // The data of an inline file came along with its inode.
+        if (ip->d.type & T_INLINE)
+                ;
+        else if (ip->d.type & T_EXTENTS)
+                err = clone_extents(ip);
+        else
+                for (int i = 0; i < NPTRS; i++)
+                        if (err)
+                                ip->d.ptrs[i] = 0;
+                        else
+                                err = clone_ptr(ip, &ip->d.ptrs[i],
+                                                get_ilevel(i));
+        iput(ip);
+        if (err) {
+                fs->printf("fs_clone: %s: Too many clones or out of blocks\n",
+                           path);
+                unlink(path);
+                return NULLINUM;
+        }
+        return inum;
+}
+
+// Move entry i of directory ip, which the caller holds, to free entry j. The
+// blocks of both are read first, so that no commit can happen between
+// writing the copy and clearing the original, and none can see the entry
+// twice or not at all.
+static void dir_move(struct inode *ip, uint32_t i, uint32_t j)
+{
+        uint32_t epb = fs->bsize / sizeof(struct dirent);
+        struct buf *from, *to;
+        struct dirent *des;
+        if (ip->d.type & T_INLINE) {
+                des = (struct dirent *)ip->d.ptrs;
+                des[j] = des[i];
+                memset(&des[i], 0, sizeof des[i]);
+                ip->dirty = 1;
+                return;
+        }
+        from = bread(bmap(ip, i / epb, 0, 0));
+        to = i / epb == j / epb ? from : bread(bmap(ip, j / epb, 0, 0));
+        des = (struct dirent *)from->data;
+        ((struct dirent *)to->data)[j % epb] = des[i % epb];
+        memset(&des[i % epb], 0, sizeof des[0]);
+        bwrite(from);
+        if (to != from) {
+                bwrite(to);
+                brelse(to);
+        }
+        brelse(from);
+}
+
+// Rewrite directory 'path' with its entries in use packed at its start, in
+// the same order, and shrink it to fit them, freeing the blocks past its new
+// end. Return the number of free entries dropped.
+int fs_compact(struct fs_mount *m, char *path)
+{
+        struct dirent des[BLOCKSIZE / sizeof(struct dirent)];
+        struct inode *ip;
+        uint32_t inum, i = 0, j = 0;
+        int moved = 0;
+        fs = m;
+        log_begin();
+        if (!(inum = lookup(path)) || !(ip = iget(inum))) {
+                fs->printf("fs_compact: %s: No such file or directory\n",
+                           path);
+                return -1;
+        }
+        if (ITYPE(&ip->d) != T_DIR) {
+                fs->printf("fs_compact: %s: Not a directory\n", path);
+                iput(ip);
+                return -1;
+        }
+        uint32_t cnt = ip->d.size / sizeof(struct dirent);
+        // Entries only move toward the start, to positions already read.
+        while (i < cnt) {
+                int n = inode_rw(inum, des, sizeof des, i * sizeof des[0], 0);
+                assert(n > 0);
+                for (int k = 0; k < n / sizeof des[0]; k++, i++) {
+                        if (!des[k].inum) continue;
+                        if (j != i) {
+                                // The index can't follow the entries.
+                                if (!moved++) dirhash_stale(&ip->d);
+                                dir_move(ip, i, j);
+                        }
+                        j++;
+                }
+        }
+        if (j != cnt) itrunc(ip, j * sizeof(struct dirent));
+        iput(ip);
+        // Positions changed, and so did the slots of the index.
+        if (j != cnt) dirhash_reindex(inum);
+        return cnt - j;
+}
+
+// Open regular file 'path' for reading and writing through a handle,
+// starting at its first byte. Return 0 if there's no such file or all handles
+// are in use. Directories can't be opened, as writes through a handle would
+// leave their index and the name cache behind.
+struct fs_file *fs_fopen(struct fs_mount *m, char *path)
+{
+        struct fs_file *f = 0;
+        uint32_t inum;
+        fs = m;
+        if (!(inum = lookup(path))) {
+                fs->printf("fs_fopen: %s: No such file or directory\n", path);
+                return 0;
+        }
+        for (int i = 0; i < FS_NFILE && !f; i++)
+                if (!fs->files[i].ip) f = &fs->files[i];
+        if (!f) {
+                fs->printf("fs_fopen: %s: Too many open files\n", path);
+                return 0;
+        }
+        if (!(f->ip = iget(inum))) return 0;
+        if (ITYPE(&f->ip->d) != T_REG) {
+                fs->printf("fs_fopen: %s: Not a regular file\n", path);
+                iput(f->ip);
+                f->ip = 0;
+                return 0;
+        }
+        f->m = m;
+        f->pos = 0;
+        return f;
+}
+
+// Read from open file f at its position and move the position past the bytes
+// read. Handles closed by fs_init() fail.
+int fs_hread(struct fs_file *f, void *buf, int sz)
+{
+        fs = f->m;
+        if (!f->ip) return -1;
+        int n = irw(f->ip, buf, sz, f->pos, 0);
+        if (n > 0) f->pos += n;
+        return n;
+}
+
+// Write to open file f at its position and move the position past the bytes
+// written. Handles closed by fs_init() fail.
+int fs_hwrite(struct fs_file *f, void *buf, int sz)
+{
+        fs = f->m;
+        if (!f->ip) return -1;
+        log_begin();
+        int n = irw(f->ip, buf, sz, f->pos, 1);
+        if (n > 0) f->pos += n;
+        return n;
+}
+
+int fs_fclose(struct fs_file *f)
+{
+        fs = f->m;
+        if (!f->ip) return -1;
+        // The file is done being written, for now at least.
+        prealloc_drop(f->ip->inum);
+        iput(f->ip);
+        f->ip = 0;
+        return 0;
+}
+
+// Take a mount for device 'dev,' accessed through the given disk functions,
+// from the pool. Return 0 if all of them are in use.
+struct fs_mount *fs_open(void *dev, diskfunc rfunc, diskfunc wfunc,
+                         printfunc pfunc)
+{
+        if (!rfunc || !wfunc || !pfunc) return 0;
+        for (int i = 0; i < FS_NMOUNT; i++)
+                if (!mounts[i].inuse) {
+                        fs = &mounts[i];
+                        memset(fs, 0, sizeof *fs);
+                        fs->inuse = 1;
+                        fs->dev = dev;
+                        fs->disk_read = rfunc;
+                        fs->disk_write = wfunc;
+                        fs->printf = pfunc;
+                        bsetsize(BLOCKSIZE);
+                        iinit();
+                        return fs;
+                }
+        return 0;
+}
+
+// Write back everything the mount holds and return it to the pool.
+int fs_close(struct fs_mount *m)
 {
-        if (!rfunc || !wfunc || !pfunc) return -1;
-        fs.disk_read = rfunc;
-        fs.disk_write = wfunc;
-        fs.printf = pfunc;
-        union block b;
-        fs.disk_read(p->startlba, &b);
-        if (b.su.magic != FSMAGIC) {
-                fs.su = b.su;
+        fs = m;
+        if (fs->init) sync_all();
+        fs->init = 0;
+        fs->inuse = 0;
+        return 0;
+}
+
+int fs_init(struct fs_mount *m, struct partition *p)
+{
+        fs = m;
+        // Cached blocks belong to the previously initialized partition.
+        // Write back whatever it left dirty before switching over.
+        if (fs->init) sync_all();
+        fs->init = 0;
+        bitmap_init();
+        iinit();
+        // The super block is in the first sector whatever the block size.
+        bsetsize(BLOCKSIZE);
+        struct buf *b = bread(p->startlba);
+        fs->su = *(struct superblock *)b->data;
+        brelse(b);
+        if (fs->su.magic != FSMAGIC) return -1;
+        uint32_t bsize = fs->su.blocksize ? fs->su.blocksize : BLOCKSIZE;
+        if (bsetsize(bsize) < 0) {
+                fs->printf("fs_init: %u: Unsupported block size\n", bsize);
+                return -1;
+        }
+        if (!fs->su.nblock_bitmap) fs->su.nblock_bitmap = 1;
+        if (fs->su.nblock_bitmap > MAXBITMAP) {
+                fs->printf("fs_init: %u: Too many bitmap blocks\n",
+                           fs->su.nblock_bitmap);
+                return -1;
+        }
+        if (GROUPS && (!GINODE || fs->su.ninodes_group % fs->ipb ||
+                       fs->su.nblock_group != GINODE + 1 + SEGBITS)) {
+                fs->printf("fs_init: Bad block groups\n");
                 return -1;
         }
-        fs.su = b.su;
-        fs.init = 1;
+        fs->log.seq = fs->log.live = 0;
+        fs->nfreed = 0;
+        if (fs->su.features & FEAT_LOG) log_replay();
+        fs->init = 1;
         return 0;
 }
 
-int fs_format(struct partition *p)
-{
-        union block b = {.bytes = {0}};
-        // Zero the partition
-        for (int i = 0; i < fs.su.nblock_tot; i++)
-                fs.disk_write(fs.su.start + i, &b);
-        // Prep the super block
-        b.su.start = p->startlba;
-        b.su.ninodes = NINODES;
-        b.su.nblock_tot = p->nsectors;
-        b.su.nblock_log = NBLOCKS_LOG;
-        b.su.nblock_inode = NINODES / NINODES_PER_BLOCK;
-        b.su.nblock_dat =
-            b.su.nblock_tot - (NBLOCKS_LOG + b.su.nblock_inode + 1 + 1);
-        b.su.slog = p->startlba + 1;
-        b.su.sinode = b.su.slog + NBLOCKS_LOG;
-        b.su.sbitmap = b.su.sinode + b.su.nblock_inode;
-        b.su.sdata = b.su.sbitmap + 1;
-        b.su.magic = FSMAGIC;
-        // Write the super block to the disk
-        fs.disk_write(p->startlba, &b);
+// Lay out the inode blocks, bitmap blocks and data blocks of 'su' one after
+// the other, with an inode per BYTES_PER_INODE bytes of the partition. Return
+// -1 if the partition is too small.
+static int layout_flat(struct superblock *su)
+{
+        su->ninodes = su->nblock_tot * fs->spb / (BYTES_PER_INODE / BLOCKSIZE);
+        if (su->ninodes < NINODES) su->ninodes = NINODES;
+        if (su->ninodes > MAXINODES) su->ninodes = MAXINODES;
+        su->nblock_inode = (su->ninodes + fs->ipb - 1) / fs->ipb;
+        uint32_t meta = 1 + NBLOCKS_LOG + su->nblock_inode;
+        if (su->nblock_tot <= meta + 1) return -1;
+        // Enough bitmap blocks for the blocks left after them, as far as we
+        // can mount. Blocks past the last one tracked are left unused.
+        su->nblock_bitmap = (su->nblock_tot - meta + SEGBITS) / (SEGBITS + 1);
+        if (su->nblock_bitmap > MAXBITMAP) su->nblock_bitmap = MAXBITMAP;
+        su->nblock_dat = su->nblock_tot - meta - su->nblock_bitmap;
+        if (su->nblock_dat > su->nblock_bitmap * SEGBITS)
+                su->nblock_dat = su->nblock_bitmap * SEGBITS;
+        su->sbitmap = su->sinode + su->nblock_inode;
+        su->sdata = su->sbitmap + su->nblock_bitmap;
+        return 0;
+}
+
+// Lay out the blocks of 'su' after the log in block groups, with an inode per
+// BYTES_PER_INODE bytes of the data blocks of a group. Return -1 if the
+// partition is too small.
+static int layout_groups(struct superblock *su)
+{
+        if (su->nblock_tot <= 1 + NBLOCKS_LOG) return -1;
+        uint32_t left = su->nblock_tot - 1 - NBLOCKS_LOG;
+        uint32_t ipg = SEGBITS * fs->bsize / BYTES_PER_INODE;
+        // There can't be more groups than this, each having SEGBITS data
+        // blocks but the last.
+        uint32_t maxg = left / SEGBITS + 1;
+        if (maxg > MAXBITMAP) maxg = MAXBITMAP;
+        if (ipg * maxg > MAXINODES) ipg = MAXINODES / maxg / fs->ipb * fs->ipb;
+        // A single group holds all of the NINODES inodes.
+        if (left <= ipg / fs->ipb + 1 + SEGBITS && ipg < NINODES)
+                ipg = (NINODES + fs->ipb - 1) / fs->ipb * fs->ipb;
+        uint32_t ginode = ipg / fs->ipb;
+        uint32_t gsize = ginode + 1 + SEGBITS;
+        // The last group is shorter, if there are blocks left for its data.
+        uint32_t ngroups = left / gsize + (left % gsize > ginode + 1);
+        if (ngroups > MAXBITMAP) ngroups = MAXBITMAP;
+        if (!ngroups) return -1;
+        uint32_t last = left - (ngroups - 1) * gsize - ginode - 1;
+        su->ninodes = ngroups * ipg;
+        su->nblock_inode = ngroups * ginode;
+        su->nblock_bitmap = ngroups;
+        su->nblock_dat = (ngroups - 1) * SEGBITS +
+                         (last < SEGBITS ? last : SEGBITS);
+        su->nblock_group = gsize;
+        su->ninodes_group = ipg;
+        su->sbitmap = su->sinode + ginode;
+        su->sdata = su->sbitmap + 1;
+        su->features |= FEAT_GROUPS;
+        return 0;
+}
+
+// Write zeros to the 'cnt' blocks starting at block n, bypassing the cache.
+// 'bufs' are fs->maxrun pointers to a zeroed block.
+static void zero_blocks(uint32_t n, uint32_t cnt, void **bufs)
+{
+        for (uint32_t i = 0; i < cnt; i += fs->maxrun)
+                disk_rw(n + i, cnt - i < fs->maxrun ? cnt - i : fs->maxrun,
+                        bufs, 1);
+}
+
+// Make a file system with blocks of 'bsize' bytes, BLOCKSIZE if 0, in
+// partition p, laid out in block groups if 'flags' has FS_FORMAT_GROUPS. Only
+// the blocks before the data blocks, or those of each group, are zeroed,
+// unless 'flags' has FS_FORMAT_ZERO: data blocks are never read before being
+// written once allocated. The partition is discarded first in that case.
+int fs_format(struct fs_mount *m, struct partition *p, uint32_t bsize,
+              int flags)
+{
+        struct superblock su = {0};
+        void *bufs[MAXRUN];
+        fs = m;
+        if (!bsize) bsize = BLOCKSIZE;
+        // Forget about any blocks cached from the partition.
+        fs->init = 0;
+        bitmap_init();
+        iinit();
+        if (bsetsize(bsize) < 0) {
+                fs->printf("fs_format: %u: Unsupported block size\n", bsize);
+                return -1;
+        }
+        // Prep the super block. The inode count and the number of bitmap
+        // blocks follow the size of the partition.
+        su.start = p->startlba;
+        su.nblock_tot = p->nsectors / fs->spb;
+        su.nblock_log = NBLOCKS_LOG;
+        su.slog = p->startlba + 1;
+        su.sinode = su.slog + NBLOCKS_LOG;
+        su.magic = FSMAGIC;
+        su.features = FEAT_DIRHASH | FEAT_INLINE | FEAT_LOG;
+        su.blocksize = bsize;
+        if ((flags & FS_FORMAT_GROUPS ? layout_groups(&su)
+                                      : layout_flat(&su)) < 0) {
+                fs->printf("fs_format: Partition too small\n");
+                return -1;
+        }
+        fs->su = su;
+        fs->log.seq = fs->log.live = 0;
+        fs->nfreed = 0;
+        // Whatever the partition held is of no use anymore.
+        if (!(flags & FS_FORMAT_ZERO)) disk_discard(su.start, su.nblock_tot);
+        // Zero the super block, log, inode blocks and bitmap, or the whole
+        // partition, and then write the super block.
+        struct buf *b = bclear(su.start, 1);
+        for (int i = 0; i < fs->maxrun; i++)
+                bufs[i] = b->data;
+        zero_blocks(su.start, flags & FS_FORMAT_ZERO ? su.nblock_tot
+                                                     : su.sdata - su.start,
+                    bufs);
+        // The inode blocks and bitmap of the other groups
+        if (GROUPS && !(flags & FS_FORMAT_ZERO))
+                for (uint32_t g = 1; g < su.nblock_bitmap; g++)
+                        zero_blocks(su.sinode + g * su.nblock_group,
+                                    su.sdata - su.sinode, bufs);
+        *(struct superblock *)b->data = su;
+        bwrite(b);
+        brelse(b);
         // Reserve inode 0 and 1 (0 for NULL and 1 for the root directory)
-        fs.su = b.su;
-        alloc_inode(T_DIR);
-        alloc_inode(T_DIR);
+        fs->init = 1;
+        alloc_inode(T_DIR, NULLINUM);
+        alloc_inode(T_DIR | T_INLINE, NULLINUM);
+        sync_all();
         return 0;
 }
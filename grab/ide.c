@@ -81,7 +81,11 @@ static struct {
 // drive selections ("abs"). Unlike ide_rw(), which reads the current drive and
 // channel selection from 'drive_sel' and 'channel_sel' set by ide_sel(), this
 // function requires explicit drive and channel selections.
-static int ide_rw_abs(int drive, int c, int h, int s, void *buf, int w)
+// Moves 'n' (1 to 256) consecutive sectors with a single command, sector i
+// from or to bufs[i]. The controller steps through sectors, heads and
+// cylinders by itself.
+static int ide_rw_abs(int drive, int c, int h, int s, int n, void **bufs,
+                      int w)
 {
         uint8_t status;
         int base = drive < 2 ? PRIMARY_BASE : SECONDARY_BASE;
@@ -96,7 +100,7 @@ static int ide_rw_abs(int drive, int c, int h, int s, void *buf, int w)
         h &= 0x0f;
         s &= 0xff;
         c &= 0xffff;
-        outb(1, base + PORT_SECCNT);
+        outb((uint8_t)n, base + PORT_SECCNT); // 0 means 256
         outb((uint8_t)s, base + PORT_SECTOR);
         outb((uint8_t)c, base + PORT_SYLLOW);
         outb((uint8_t)(c >> 8), base + PORT_SYLHIGH);
@@ -104,39 +108,54 @@ static int ide_rw_abs(int drive, int c, int h, int s, void *buf, int w)
              base + PORT_SEL);
         if (w) {
                 outb(CMD_WRSECT, base + PORT_COMMAND);
-                // The first sector may be written to the buffer *immediately*
-                // after the command has been sent, and data request is active.
-                outsl(buf, base + PORT_DATA, BLOCKSIZE / 4);
+                for (int i = 0; i < n; i++) {
+                        // The first sector may be written to the buffer
+                        // *immediately* after the command has been sent, and
+                        // data request is active. Each following one may only
+                        // go once the controller asks for it again.
+                        if (i)
+                                while ((inb(base + PORT_STATUS) &
+                                        (STATUS_BUSY | STATUS_DRQ)) !=
+                                       STATUS_DRQ)
+                                        ;
+                        outsl(bufs[i], base + PORT_DATA, BLOCKSIZE / 4);
+                }
         } else {
                 outb(CMD_RDSECT, base + PORT_COMMAND);
-                // Need to wait until the controller is ready!
-                // This is usually done in the IRQ14 handler, but we can do it
-                // here cus the CPU doesn't have much else to do anyway when
-                // running the bootloader. Check the busy bit first. It's being
-                // set indicates the controller is exeucting the command. When
-                // this bit is set no other bit is valid in the status register!
-                while ((status = inb(base + PORT_STATUS)) & STATUS_BUSY)
-                        ;
-                // Now the controller has done executing the command. We can
-                // check for errors.
-                if (status & STATUS_ERR) return -1;
-                // Check if the controller's ready to do a read operation.
-                while (((status = inb(base + PORT_STATUS)) &
-                        (STATUS_READY | STATUS_SEEK)) !=
-                       (STATUS_READY | STATUS_SEEK))
-                        ;
-                // Do it!
-                insl(base + PORT_DATA, buf, BLOCKSIZE / 4);
+                for (int i = 0; i < n; i++) {
+                        // Need to wait until the controller is ready!
+                        // This is usually done in the IRQ14 handler, but we
+                        // can do it here cus the CPU doesn't have much else to
+                        // do anyway when running the bootloader. Check the busy
+                        // bit first. It's being set indicates the controller is
+                        // exeucting the command. When this bit is set no other
+                        // bit is valid in the status register! The controller
+                        // goes busy again before each sector of the command.
+                        while ((status = inb(base + PORT_STATUS)) &
+                               STATUS_BUSY)
+                                ;
+                        // Now the controller has done reading the sector. We
+                        // can check for errors.
+                        if (status & STATUS_ERR) return -1;
+                        // Check if the controller's ready to do a read
+                        // operation.
+                        while (((status = inb(base + PORT_STATUS)) &
+                                (STATUS_READY | STATUS_SEEK)) !=
+                               (STATUS_READY | STATUS_SEEK))
+                                ;
+                        // Do it!
+                        insl(base + PORT_DATA, bufs[i], BLOCKSIZE / 4);
+                }
         }
         return 0;
 }
 
-static int ide_rw(int c, int h, int s, void *buf, int w)
+static int ide_rw(int c, int h, int s, int n, void **bufs, int w)
 {
         struct ide_drive *drive = &ide.drives[ide.drive_sel];
         if (c >= 0 || c < drive->max_c || h >= 0 || h < drive->max_h ||
             s >= 1 || s < 63)
-                return ide_rw_abs(ide.drive_sel, c, h, s, buf, w);
+                return ide_rw_abs(ide.drive_sel, c, h, s, n, bufs, w);
         printf("request (%d,%d,%d) out of bounds (%d,%d,%d)\n", c, h, s,
                drive->max_c, drive->max_h, 63);
         return -1;
@@ -148,6 +167,7 @@ void ide_init()
         // Check the presence of drives on each IDE channel
         for (int drivenum = 0; drivenum < 4; drivenum++) {
                 union block b;
+                void *bufs[1] = {&b};
                 int max_c = 0;
                 int max_h = 0;
                 struct partition *p =
@@ -161,11 +181,11 @@ void ide_init()
                         ;
                 if (!retry_cnt) continue;
                 // Probe the drive geometry
-                for (; ide_rw_abs(drivenum, max_c, 0, 1, &b, 0) >= 0 &&
+                for (; ide_rw_abs(drivenum, max_c, 0, 1, 1, bufs, 0) >= 0 &&
                        max_c < 1024 + 1;
                      max_c++)
                         ;
-                for (; ide_rw_abs(drivenum, 0, max_h, 1, &b, 0) >= 0 &&
+                for (; ide_rw_abs(drivenum, 0, max_h, 1, 1, bufs, 0) >= 0 &&
                        max_h < 16;
                      max_h++)
                         ;
@@ -175,7 +195,7 @@ void ide_init()
                         max_h = -1;
                 }
                 // Is this an msdos partitioned drive?
-                ide_rw_abs(drivenum, 0, 0, 1, &b, 0);
+                ide_rw_abs(drivenum, 0, 0, 1, 1, bufs, 0);
                 if (*(uint16_t *)&b.bytes[510] == 0xaa55) {
                         drive->msdos = 1;
                         // Read the partition table from the MBR.
@@ -209,10 +229,13 @@ struct partition *ide_get_partitions()
 
 int ide_write(int c, int h, int s, void *buf)
 {
-        return ide_rw(c, h, s, buf, 1);
+        return ide_rw(c, h, s, 1, &buf, 1);
 }
 
-int ide_read(int c, int h, int s, void *buf) { return ide_rw(c, h, s, buf, 0); }
+int ide_read(int c, int h, int s, void *buf)
+{
+        return ide_rw(c, h, s, 1, &buf, 0);
+}
 
 static void lba_to_chs(int lba, int *c, int *h, int *s)
 {
@@ -235,3 +258,52 @@ int ide_read_lba(int lba, void *buf)
         lba_to_chs(lba, &c, &h, &s);
         return ide_read(c, h, s, buf);
 }
+
+// Move 'n' consecutive sectors starting at 'lba' using as few commands as
+// possible. Sector i goes from or to bufs[i].
+static int ide_rangerw_lba(int lba, int n, void **bufs, int w)
+{
+        int c, h, s;
+        for (; n > 0; lba += 256, bufs += 256, n -= 256) {
+                lba_to_chs(lba, &c, &h, &s);
+                if (ide_rw(c, h, s, n < 256 ? n : 256, bufs, w) < 0) return -1;
+        }
+        return 0;
+}
+
+int ide_writev_lba(int lba, int n, void **bufs)
+{
+        return ide_rangerw_lba(lba, n, bufs, 1);
+}
+
+int ide_readv_lba(int lba, int n, void **bufs)
+{
+        return ide_rangerw_lba(lba, n, bufs, 0);
+}
+
+// Disk functions for the fs, which hands them back the drive number given to
+// fs_open() as 'dev.'
+
+void ide_read_dev(void *dev, int lba, void *buf)
+{
+        ide_sel((int)dev);
+        ide_read_lba(lba, buf);
+}
+
+void ide_write_dev(void *dev, int lba, void *buf)
+{
+        ide_sel((int)dev);
+        ide_write_lba(lba, buf);
+}
+
+void ide_readv_dev(void *dev, int lba, int n, void **bufs)
+{
+        ide_sel((int)dev);
+        ide_readv_lba(lba, n, bufs);
+}
+
+void ide_writev_dev(void *dev, int lba, int n, void **bufs)
+{
+        ide_sel((int)dev);
+        ide_writev_lba(lba, n, bufs);
+}
@@ -3,3 +3,9 @@ int ide_sel(int drivenum);
 struct partition *ide_get_partitions();
 void ide_write_lba(int lba, void *buf);
 void ide_read_lba(int lba, void *buf);
+int ide_writev_lba(int lba, int n, void **bufs);
+int ide_readv_lba(int lba, int n, void **bufs);
+void ide_write_dev(void *dev, int lba, void *buf);
+void ide_read_dev(void *dev, int lba, void *buf);
+void ide_writev_dev(void *dev, int lba, int n, void **bufs);
+void ide_readv_dev(void *dev, int lba, int n, void **bufs);
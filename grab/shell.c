@@ -12,6 +12,10 @@
 struct {
         int rootdrive;
         int rootpartition;
+        struct fs_mount *root; // Mount of the root partition
+        // Partitions stay mounted once accessed, keeping their caches warm
+        // for the next command, mounts[X][Y] being partition Y in drive X.
+        struct fs_mount *mounts[4][4];
 } grab = {-1, -1};
 
 #define COLOR (BGND_BLACK | FGND_WHITE)
@@ -75,10 +79,22 @@ static int getXY(char *s, int *X, int *Y, char *caller)
                 return -1;
         }
 
-        if (fs_init(&partitions[y], ide_read_lba, ide_write_lba,
-                    (printfunc)printf) < 0) {
-                printf("%s: no fs detected in partition: %d\n", caller, y);
-                return -1;
+        // The drive number is handed back to the disk functions.
+        struct fs_mount **m = &grab.mounts[x][y];
+        if (!*m) {
+                if (!(*m = fs_open((void *)x, ide_read_dev, ide_write_dev,
+                                   (printfunc)printf))) {
+                        printf("%s: too many mounted partitions\n", caller);
+                        return -1;
+                }
+                fs_setrange(*m, ide_readv_dev, ide_writev_dev);
+                if (fs_init(*m, &partitions[y]) < 0) {
+                        fs_close(*m);
+                        *m = 0;
+                        printf("%s: no fs detected in partition: %d\n",
+                               caller, y);
+                        return -1;
+                }
         }
 
         *X = x;
@@ -105,20 +121,19 @@ static void ls(char *args)
 
         path += 7;
 
-        uint32_t inum = fs_lookup(path);
+        struct fs_mount *m = grab.mounts[X][Y];
+        uint32_t inum = fs_lookup(m, path);
         if (inum == NULLINUM) {
                 printf("ls: %s: no such file or directory\n", path);
                 return;
         }
-        uint32_t off = 0;
-        for (;;) {
-                struct dirent d;
-                int n = fs_read(inum, &d, sizeof d, off);
-                assert(n >= 0);
-                if (!n) break;
-                if (d.inum) printf("%s\n", d.name);
-                off += sizeof d;
-        }
+        struct fs_dir dir;
+        struct dirent des[NDIRENTS_PER_BLOCK];
+        int n;
+        if (fs_opendir(m, inum, &dir, 0) < 0) return;
+        while ((n = fs_readdir(m, &dir, des, NDIRENTS_PER_BLOCK)) > 0)
+                for (int i = 0; i < n; i++)
+                        printf("%s\n", des[i].name);
 }
 
 static void cat(char *args)
@@ -134,26 +149,17 @@ static void cat(char *args)
                 return;
         }
         char buf[64];
-        uint32_t off = 0;
-        uint32_t inum = fs_lookup(path);
-        if (inum == NULLINUM) {
-                printf("cat: %s: no such file\n", path);
-                return;
-        }
-        struct dinode di;
-        assert(fs_geti(inum, &di) >= 0);
-        if (di.type != T_REG) {
-                printf("cat: not a regular file:\n", path);
-                return;
-        }
+        // fs_fopen() tells why a file can't be opened.
+        struct fs_file *f = fs_fopen(grab.root, path);
+        if (!f) return;
         for (;;) {
-                int n = fs_read(inum, buf, 64 - 1, off);
+                int n = fs_hread(f, buf, 64 - 1);
                 assert(n >= 0);
-                off += n;
-                if (n == 0) return;
+                if (n == 0) break;
                 buf[n] = 0;
                 printf("%s", buf);
         }
+        fs_fclose(f);
 }
 
 static void boot()
@@ -163,20 +169,21 @@ static void boot()
                 return;
         }
 
-        uint32_t inum = fs_lookup("/boot");
+        uint32_t inum = fs_lookup(grab.root, "/boot");
         assert(inum != NULLINUM);
 
         vga_reset();
-        uint32_t off = 0;
         int cnt = 0;
-        struct dirent d;
+        struct fs_dir dir;
+        struct dirent des[NDIRENTS_PER_BLOCK], d;
         int n;
-        for (;; cnt++) {
-                n = fs_read(inum, &d, sizeof d, off);
-                assert(n >= 0);
-                if (!n) break;
-                if (d.inum) printf("%s\n", d.name);
-                off += sizeof d;
+        assert(fs_opendir(grab.root, inum, &dir, 0) >= 0);
+        while ((n = fs_readdir(grab.root, &dir, des, NDIRENTS_PER_BLOCK)) > 0)
+                for (int i = 0; i < n; i++, cnt++)
+                        printf("%s\n", des[i].name);
+        if (!cnt) {
+                printf("boot: /boot is empty\n");
+                return;
         }
 
         int row = 0;
@@ -199,22 +206,24 @@ static void boot()
                 }
         }
 
-        n = fs_read(inum, &d, sizeof d, row * sizeof d);
-        assert(n == sizeof d);
+        // Rows only show the entries in use, in the order listed.
+        assert(fs_opendir(grab.root, inum, &dir, 0) >= 0);
+        for (;;) {
+                assert((n = fs_readdir(grab.root, &dir, des,
+                                       NDIRENTS_PER_BLOCK)) > 0);
+                if (row < n) break;
+                row -= n;
+        }
+        d = des[row];
         printf("booting %s...\n", d.name);
         printf("loading system at 0x100000\n");
 
-        char *p = (char *)0x100000;
-        char buf[BLOCKSIZE];
-        off = 0;
-        for (;;) {
-                n = fs_read(d.inum, buf, BLOCKSIZE, off);
-                assert(n >= 0);
-                if (!n) break;
-                memcpy(p, buf, n);
-                off += n;
-                p += BLOCKSIZE;
-        }
+        // Whole blocks of the kernel are read from the disk straight into
+        // place without passing through the fs cache.
+        struct dinode di;
+        assert(fs_geti(grab.root, d.inum, &di) >= 0);
+        n = fs_read(grab.root, d.inum, (void *)0x100000, di.size, 0);
+        assert(n == di.size);
 
         ((void (*)(void))0x100000)();
 }
@@ -250,7 +259,8 @@ static void set(char *args)
                 if (getXY(value, &X, &Y, "set") < 0) return;
 
                 // Search for the 'boot' directory
-                uint32_t inum = fs_lookup("/boot");
+                struct fs_mount *m = grab.mounts[X][Y];
+                uint32_t inum = fs_lookup(m, "/boot");
                 if (inum == NULLINUM) {
                         printf("set: /boot not found\n");
                         return;
@@ -258,8 +268,8 @@ static void set(char *args)
 
                 // /boot must be a non-empty directory
                 struct dinode di;
-                assert(fs_geti(inum, &di) >= 0);
-                if (di.type != T_DIR) {
+                assert(fs_geti(m, inum, &di) >= 0);
+                if (ITYPE(&di) != T_DIR) {
                         printf("set: /boot is not a directoy\n");
                         return;
                 }
@@ -271,6 +281,7 @@ static void set(char *args)
 
                 grab.rootdrive = X;
                 grab.rootpartition = Y;
+                grab.root = m;
         } else {
                 printf("set: invalid name: %s\n", name);
         }
@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <fs.h>
 #include <fs-api.h>
+#include <util.h>
 
 struct addr_range_desc {
         uint32_t baselow;
@@ -23,8 +24,13 @@ void start2(int pcimod, struct addr_range_desc *mem_map, int mapsz)
 
 void shell();
 
+// Bounds of .bss, defined in stage2.ld
+extern char _bss_start[], _bss_end[];
+
 void start2(int pcimod, struct addr_range_desc *mem_map, int mapsz)
 {
+        // .bss lives outside the image stage1 loaded, so nobody zeroed it.
+        memset(_bss_start, 0, _bss_end - _bss_start);
         printf("probing pci devices...\n");
         pci_prob_dev(0);
         pci_list();
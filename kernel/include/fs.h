@@ -1,14 +1,30 @@
 // FS layout
 //
-// super block | log blocks | inode blocks | bitmap block | data blocks
+// super block | log blocks | inode blocks | bitmap blocks | data blocks
+//
+// or, with FEAT_GROUPS,
+//
+// super block | log blocks | group 0 | group 1 | ...
+//
+// where each group is made of inode blocks, one bitmap block, and the data
+// blocks that bitmap block tracks, the last group possibly having fewer.
 
 // Fixed fs parameters
-#define BLOCKSIZE   512
-#define NBLOCKS_LOG 30
-#define NINODES     200
-#define FSMAGIC     0xdeadbeef
-#define NULLINUM    0
-#define ROOTINUM    1 // root directory inode number
+// BLOCKSIZE is the size of a disk sector, the unit of the disk functions, and
+// the default block size. A file system may use larger blocks, any power of
+// two up to MAXBLOCKSIZE; its block size is recorded in the super block.
+#define BLOCKSIZE    512
+#define MAXBLOCKSIZE 4096
+#define NBLOCKS_LOG  30
+// A file system gets an inode per BYTES_PER_INODE bytes of its partition,
+// but at least NINODES, and at most MAXINODES so that inode numbers fit in a
+// directory entry.
+#define NINODES         200
+#define MAXINODES       65536
+#define BYTES_PER_INODE 16384
+#define FSMAGIC      0xdeadbeef
+#define NULLINUM     0
+#define ROOTINUM     1 // root directory inode number
 
 // Each file system is in charge of a disk partition
 // and the super block structure describe the whole
@@ -17,7 +33,9 @@
 // in the perspective of the whole disk just like a partition
 // can be formed almost anywhere in a disk.
 struct superblock {
-        // Start block of the file system in the disk
+        // Start block of the file system in the disk. Blocks are numbered
+        // from here on, block start + i covering sectors
+        // start + i * blocksize / BLOCKSIZE and following.
         uint32_t start;
         uint32_t ninodes;
         uint32_t nblock_tot;
@@ -31,8 +49,40 @@ struct superblock {
         uint32_t sdata;
         // Magic number
         uint32_t magic;
+        // Optional features in use (FEAT_*). File systems made before
+        // features existed have 0 here.
+        uint32_t features;
+        // Size of a block in bytes. File systems made before block sizes
+        // were configurable have 0 here and use BLOCKSIZE.
+        uint32_t blocksize;
+        // Number of bitmap blocks. File systems made before the bitmap could
+        // span several blocks have 0 here and a single one.
+        uint32_t nblock_bitmap;
+        // With FEAT_GROUPS, the size of a group and the number of inodes in
+        // each. There are nblock_bitmap groups, and sinode, sbitmap and sdata
+        // are those of group 0.
+        uint32_t nblock_group;
+        uint32_t ninodes_group;
+        // With FEAT_REFLINK, the inode of the hidden file counting the
+        // references to shared data blocks
+        uint32_t irefcount;
 };
 
+// Directories have hash indexes (see struct dirhash)
+#define FEAT_DIRHASH 0x1
+// New files and directories keep their data in their inode (T_INLINE) until
+// they outgrow it
+#define FEAT_INLINE 0x2
+// The blocks after the log are laid out in block groups
+#define FEAT_GROUPS 0x4
+// Metadata changes go through the log (see struct logheader)
+#define FEAT_LOG 0x8
+// Files may share data blocks, one byte per data block of the 'irefcount'
+// file counting the files sharing it besides the first
+#define FEAT_REFLINK 0x10
+
+// Derived from the default block size. The fs computes its own from the
+// block size of the file system at mount time.
 #define NINODES_PER_BLOCK  (BLOCKSIZE / sizeof(struct dinode))
 #define NDIRENTS_PER_BLOCK (BLOCKSIZE / sizeof(struct dirent))
 #define NPTRS_PER_BLOCK    (BLOCKSIZE / sizeof(uint32_t))
@@ -46,6 +96,10 @@ struct superblock {
 #define T_REG 1
 #define T_DIR 2
 #define T_DEV 3
+// Flags kept in the high byte of 'type' along with the type
+#define T_EXTENTS 0x100 // 'ptrs' holds extents rather than block pointers
+#define T_INLINE  0x200 // 'ptrs' holds the data of the file itself
+#define ITYPE(di) ((di)->type & 0xff)
 // On-disk inode sturcture
 struct dinode {
         uint16_t type;
@@ -56,6 +110,26 @@ struct dinode {
         uint32_t ptrs[NPTRS];
 };
 
+// An extent maps 'len' consecutive blocks of a file to the disk blocks
+// starting at 'start,' or to a hole if 'start' is 0. The 'ptrs' of an inode
+// with T_EXTENTS hold the first NIEXTENTS extents of the file, which cover it
+// in order from its first block, followed by the block number of an extent
+// block holding the next ones, or 0. Unused extents have 'len' 0.
+struct extent {
+        uint32_t start;
+        uint32_t len;
+};
+#define NIEXTENTS    ((NPTRS - 1) * sizeof(uint32_t) / sizeof(struct extent))
+#define EXTBLOCK(di) ((di)->ptrs[NPTRS - 1])
+
+// Largest size of a file with T_INLINE
+#define INLINE_MAX (NPTRS * sizeof(uint32_t))
+
+// Directories have no use for device numbers. With FEAT_DIRHASH, 'major' and
+// 'minor' of a directory inode hold the low and high half of the block number
+// of its hash index, or 0 if it has none.
+#define DIRINDEX(di) ((uint32_t)(di)->minor << 16 | (di)->major)
+
 // Directory entry sturcture
 // Each directory contains an array of directory entries,
 // each pointing to an inode representing a file or another directory.
@@ -68,6 +142,18 @@ struct dirent {
         char name[MAXNAME];
 };
 
+// Hash index of a directory, an open addressing hash table mapping names to
+// directory entries. Each slot holds 0 if unused, DIRHASH_DELETED if the
+// entry it held has been removed, or the index of a directory entry plus 1.
+// The index is only trusted if 'nentries' matches the number of entries in
+// the directory, so a directory grown by code unaware of the index simply
+// has its index rebuilt. The slots fill the rest of the block.
+#define DIRHASH_DELETED 0xffff
+struct dirhash {
+        uint32_t nentries;
+        uint16_t slots[];
+};
+
 union block {
         struct superblock su;
         uint8_t bytes[BLOCKSIZE];
@@ -76,6 +162,23 @@ union block {
         struct dirent dirents[NDIRENTS_PER_BLOCK];
 };
 
+// The log is split in two halves used in turn, each made of a header block
+// followed by up to LOGSIZE blocks. A transaction writes the new contents of
+// the blocks it changes to a half, and is committed once the header of that
+// half is written, after which the blocks may be written to their home
+// location at any time. The transaction of the header with the highest 'seq'
+// is written home again when the file system is mounted. The header takes up
+// the first sector of its block, which is written at once.
+#define LOGMAGIC 0x4c4f4721
+#define LOGHALF  (NBLOCKS_LOG / 2)
+#define LOGSIZE  (LOGHALF - 1)
+struct logheader {
+        uint32_t magic;
+        uint32_t seq;
+        uint32_t n;               // Blocks logged, 0 once all written home
+        uint32_t blocks[LOGSIZE]; // Home location of each of them
+};
+
 // Partition table entry
 struct partition {
         uint8_t bootable;
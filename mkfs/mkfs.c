@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // fallocate()
 #include <time.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -7,6 +8,7 @@
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
@@ -16,8 +18,29 @@
 #define min(x, y) (x < y ? x : y)
 #define max(x, y) (x > y ? x : y)
 
-struct {
+// Bytes moved per fs_read()/fs_write() call by migrate and retrieve, large
+// enough for the fs to turn each call into a few multi-block disk requests.
+#define CHUNK (32 * BLOCKSIZE)
+
+// Number of images that can be open at once
+#define NIMAGE 4
+
+// Geometry of the drives the top Makefile makes, to tell which cylinder a
+// sector is on
+#define NHEADS   16
+#define NSECTORS 63
+
+// An open image and the partition of it mounted
+struct image {
         int fd;
+        struct fs_mount *m;
+        struct partition part;
+        uint32_t cyl;   // Cylinder of the last sector accessed
+        uint32_t nseek; // Number of times that changed
+};
+
+struct {
+        struct image images[NIMAGE];
 } mkfs;
 
 static void panic(char *s)
@@ -27,16 +50,64 @@ static void panic(char *s)
                 ;
 }
 
-static void disk_write(int n, void *buf)
+// Account for an access to sector n of image 'img.'
+static void seek(struct image *img, int n)
+{
+        uint32_t cyl = n / (NHEADS * NSECTORS);
+        if (cyl != img->cyl) img->nseek++;
+        img->cyl = cyl;
+}
+
+static void disk_write(void *dev, int n, void *buf)
+{
+        int fd = ((struct image *)dev)->fd;
+        seek(dev, n);
+        assert(lseek(fd, n * BLOCKSIZE, SEEK_SET) == n * BLOCKSIZE);
+        assert(write(fd, buf, BLOCKSIZE) == BLOCKSIZE);
+}
+
+static void disk_read(void *dev, int n, void *buf)
+{
+        int fd = ((struct image *)dev)->fd;
+        seek(dev, n);
+        assert(lseek(fd, n * BLOCKSIZE, SEEK_SET) == n * BLOCKSIZE);
+        assert(read(fd, buf, BLOCKSIZE) == BLOCKSIZE);
+}
+
+static void disk_rangerw(void *dev, int n, int cnt, void **bufs, int w)
 {
-        assert(lseek(mkfs.fd, n * BLOCKSIZE, SEEK_SET) == n * BLOCKSIZE);
-        assert(write(mkfs.fd, buf, BLOCKSIZE) == BLOCKSIZE);
+        int fd = ((struct image *)dev)->fd;
+        struct iovec iov[cnt];
+        seek(dev, n);
+        seek(dev, n + cnt - 1);
+        for (int i = 0; i < cnt; i++) {
+                iov[i].iov_base = bufs[i];
+                iov[i].iov_len = BLOCKSIZE;
+        }
+        ssize_t sz = w ? pwritev(fd, iov, cnt, (off_t)n * BLOCKSIZE)
+                       : preadv(fd, iov, cnt, (off_t)n * BLOCKSIZE);
+        assert(sz == cnt * BLOCKSIZE);
 }
 
-static void disk_read(int n, void *buf)
+static void disk_readv(void *dev, int n, int cnt, void **bufs)
 {
-        assert(lseek(mkfs.fd, n * BLOCKSIZE, SEEK_SET) == n * BLOCKSIZE);
-        assert(read(mkfs.fd, buf, BLOCKSIZE) == BLOCKSIZE);
+        disk_rangerw(dev, n, cnt, bufs, 0);
+}
+
+static void disk_writev(void *dev, int n, int cnt, void **bufs)
+{
+        disk_rangerw(dev, n, cnt, bufs, 1);
+}
+
+// Punch discarded sectors out of the image file where the host supports it,
+// so that they take no space in it and read back as zeros.
+static void disk_discard(void *dev, int n, int cnt)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+        fallocate(((struct image *)dev)->fd,
+                  FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)n * BLOCKSIZE, (off_t)cnt * BLOCKSIZE);
+#endif
 }
 
 // Find the next word in a null-terminated string.
@@ -57,26 +128,101 @@ static char *nextword(char *s, char word[])
         return s;
 }
 
+// Paths within the file systems take the form [<image>:]<path>, where
+// <image> is the number 'open' gave the image, 0 being the one given on the
+// command line and the default. Return the mount of the image and the path
+// within it in *path.
+static struct fs_mount *getmount(char *arg, char **path)
+{
+        char *p = strchr(arg, ':');
+        int n = 0;
+        if (p) {
+                n = atoi(arg);
+                *path = p + 1;
+        } else
+                *path = arg;
+        if (n < 0 || n >= NIMAGE || !mkfs.images[n].m) {
+                printf("mkfs: %s: no such image\n", arg);
+                return 0;
+        }
+        return mkfs.images[n].m;
+}
+
+// List a directory. With -l, also print the inode number, type and size of
+// each entry.
 void do_ls(char *s)
 {
-        char path[64];
-        if (!nextword(s, path)) {
-                printf("usage: ls <path>");
+        char arg[64];
+        char *path;
+        struct fs_mount *m;
+        struct fs_dir dir;
+        struct dirent des[NDIRENTS_PER_BLOCK];
+        int n, l = 0;
+        if ((s = nextword(s, arg)) && !strcmp(arg, "-l")) {
+                l = 1;
+                s = nextword(s, arg);
+        }
+        if (!s) {
+                printf("usage: ls [-l] <path>\n");
                 return;
         }
-        uint32_t inum = fs_lookup(path);
+        if (!(m = getmount(arg, &path))) return;
+        uint32_t inum = fs_lookup(m, path);
         if (inum == NULLINUM) {
                 printf("ls: %s: No such file or directory\n", path);
                 return;
         }
-        uint32_t off = 0;
+        if (fs_opendir(m, inum, &dir, l ? FS_DIR_STAT : 0) < 0) return;
+        while ((n = fs_readdir(m, &dir, des, NDIRENTS_PER_BLOCK)) > 0)
+                for (int i = 0; i < n; i++) {
+                        struct dinode di;
+                        if (!l) {
+                                printf("%s\n", des[i].name);
+                                continue;
+                        }
+                        fs_geti(m, des[i].inum, &di);
+                        printf("%5u %c %9u %s\n", des[i].inum,
+                               "?-dc"[ITYPE(&di) <= T_DEV ? ITYPE(&di) : 0],
+                               di.size, des[i].name);
+                }
+}
+
+// Create a regular file, or empty it if it exists already, keeping its inode
+// and directory entry.
+static uint32_t create(struct fs_mount *m, char *path, uint16_t type)
+{
+        uint32_t inum = fs_lookup(m, path);
+        if (inum != NULLINUM) return fs_truncate(m, inum, 0) < 0 ? 0 : inum;
+        if ((inum = fs_mknod(m, path, type)) == NULLINUM) panic("fs error");
+        return inum;
+}
+
+// Write the contents of host file 'fd' to file 'inum.' Only the data of a
+// sparse host file is copied, its holes are left as holes. Return -1 if the
+// file system didn't take all of it.
+static int copyin(int fd, struct fs_mount *m, uint32_t inum)
+{
+        off_t size = lseek(fd, 0, SEEK_END), off = 0, end = size;
+        int n = 0;
         for (;;) {
-                struct dirent d;
-                uint32_t n = fs_read(inum, &d, sizeof d, off);
-                if (!n) break;
-                if (d.inum) printf("%s\n", d.name);
-                off += sizeof d;
+                char buf[CHUNK];
+#ifdef SEEK_DATA
+                if ((off = lseek(fd, off, SEEK_DATA)) < 0) break;
+                end = lseek(fd, off, SEEK_HOLE);
+#endif
+                for (; off < end; off += n) {
+                        n = pread(fd, buf, min(CHUNK, end - off), off);
+                        assert(n > 0);
+                        if (fs_write(m, inum, buf, n, off) != n) {
+                                n = -1;
+                                break;
+                        }
+                }
+                if (n < 0 || end == size) break;
         }
+        // The file ends with a hole, if it doesn't end with data.
+        if (n >= 0 && fs_truncate(m, inum, size) < 0) n = -1;
+        return n < 0 ? -1 : 0;
 }
 
 void do_migrate(char *s)
@@ -88,29 +234,46 @@ void do_migrate(char *s)
                         return;
                 }
         }
-        uint32_t inum = fs_lookup(paths[1]);
-        if (inum != NULLINUM) {
-                printf("migrate: %s: File exists\n", paths[1]);
-                return;
-        }
-        inum = fs_mknod(paths[1], T_REG);
-        if (inum == NULLINUM) panic("fs error");
+        char *path;
+        struct fs_mount *m;
+        if (!(m = getmount(paths[1], &path))) return;
         int fd = open(paths[0], O_RDWR);
         if (fd < 0) {
                 perror("open");
                 return;
         }
-        uint32_t off = 0;
-        for (;;) {
-                char c;
-                int n = read(fd, &c, 1);
-                if (!n) break;
-                int nn = fs_write(inum, &c, 1, off++);
-                if (nn != 1) panic("fs error!");
+        // New files are mapped with extents, which take a single lookup to
+        // map a file written contiguously. A file too fragmented to fit in
+        // its extents is written again with block pointers.
+        uint32_t inum = create(m, path, T_REG | T_EXTENTS);
+        struct dinode di;
+        if (inum != NULLINUM && copyin(fd, m, inum) < 0) {
+                if (fs_geti(m, inum, &di) < 0 || !(di.type & T_EXTENTS))
+                        panic("fs error!");
+                printf("migrate: %s: too fragmented for extents\n", path);
+                if (fs_unlink(m, path) < 0) panic("fs error!");
+                inum = create(m, path, T_REG);
+                if (copyin(fd, m, inum) < 0) panic("fs error!");
         }
         close(fd);
 }
 
+// Find the next range of file 'inum' holding data from offset '*off' on, as
+// SEEK_DATA and SEEK_HOLE would, and set '*off' and '*end' to its bounds.
+// Return 0 if there's none left.
+static int nextdata(struct fs_mount *m, uint32_t inum, uint32_t *off,
+                    uint32_t *end)
+{
+        struct fs_extent e;
+        while (fs_fiemap(m, inum, *off, &e, 1) > 0) {
+                *off = *end = e.off + e.len;
+                if (e.flags & FS_EXTENT_HOLE) continue;
+                *off = e.off;
+                return 1;
+        }
+        return 0;
+}
+
 void do_retrieve(char *s)
 {
         char paths[2][64];
@@ -120,8 +283,12 @@ void do_retrieve(char *s)
                         return;
                 }
         }
-        uint32_t inum = fs_lookup(paths[0]);
-        if (inum == NULLINUM) {
+        char *path;
+        struct fs_mount *m;
+        struct dinode di;
+        if (!(m = getmount(paths[0], &path))) return;
+        uint32_t inum = fs_lookup(m, path), off = 0, end;
+        if (inum == NULLINUM || fs_geti(m, inum, &di) < 0) {
                 printf("retrieve: %s: No such file or directory\n", paths[0]);
                 return;
         }
@@ -130,13 +297,19 @@ void do_retrieve(char *s)
                 perror("open");
                 return;
         }
-        uint32_t off = 0;
-        for (;;) {
-                char c;
-                int n = fs_read(inum, &c, 1, off++);
-                if (!n) break;
-                write(fd, &c, 1);
-        }
+        // Holes are skipped over, so they are left as holes in the host file.
+        while (nextdata(m, inum, &off, &end))
+                for (int n; off < end; off += n) {
+                        char buf[CHUNK];
+                        n = fs_read(m, inum, buf, min(CHUNK, end - off), off);
+                        if (n <= 0) panic("fs error!");
+                        if (pwrite(fd, buf, n, off) != n) {
+                                perror("write");
+                                close(fd);
+                                return;
+                        }
+                }
+        if (ftruncate(fd, di.size) < 0) perror("ftruncate");
         close(fd);
 }
 
@@ -169,17 +342,19 @@ void do_read(char *s, int w)
                 printf("read: %s: invalid offset\n", buf);
                 return;
         }
-        uint32_t inum = fs_lookup(path);
+        struct fs_mount *m;
+        if (!(m = getmount(path, &p))) return;
+        uint32_t inum = fs_lookup(m, p);
         if (inum == NULLINUM) {
                 printf("read: %s: No such file or directory\n", path);
                 return;
         }
         if (w) {
-                int n = fs_write(inum, buf, min(64, sz), off);
+                int n = fs_write(m, inum, buf, min(64, sz), off);
                 if (n != min(64, sz)) panic("fs error");
                 return;
         }
-        int n = fs_read(inum, buf, min(64, sz), off);
+        int n = fs_read(m, inum, buf, min(64, sz), off);
         for (int i = 0; i < n; i++) {
                 if (isprint(buf[i]))
                         printf("%c", buf[i]);
@@ -190,44 +365,285 @@ void do_read(char *s, int w)
 
 void do_mkdir(char *s)
 {
-        char path[64];
-        if (!nextword(s, path)) printf("usage: mkdir <path>\n");
-        fs_mknod(path, T_DIR);
+        char arg[64];
+        char *path;
+        struct fs_mount *m;
+        if (!nextword(s, arg)) printf("usage: mkdir <path>\n");
+        if (!(m = getmount(arg, &path))) return;
+        fs_mknod(m, path, T_DIR);
 }
 
 void do_touch(char *s)
 {
-        char path[64];
-        if (!nextword(s, path)) printf("usage: touch <path>\n");
-        fs_mknod(path, T_REG);
+        char arg[64];
+        char *path;
+        struct fs_mount *m;
+        if (!nextword(s, arg)) printf("usage: touch <path>\n");
+        if (!(m = getmount(arg, &path))) return;
+        fs_mknod(m, path, T_REG);
 }
 
-int main(int argc, char *argv[])
+void do_rm(char *s)
 {
-        if (argc < 3) {
-                fprintf(stderr, "usage: main <vhd_name> <partition_num>\n");
-                exit(1);
+        char arg[64];
+        char *path;
+        struct fs_mount *m;
+        if (!nextword(s, arg)) {
+                printf("usage: rm <path>\n");
+                return;
+        }
+        if (!(m = getmount(arg, &path))) return;
+        fs_unlink(m, path);
+}
+
+void do_compact(char *s)
+{
+        char arg[64];
+        char *path;
+        struct fs_mount *m;
+        int n;
+        if (!nextword(s, arg)) {
+                printf("usage: compact <path>\n");
+                return;
         }
+        if (!(m = getmount(arg, &path))) return;
+        if ((n = fs_compact(m, path)) >= 0)
+                printf("%d free entries dropped\n", n);
+}
 
-        mkfs.fd = open(argv[1], O_RDWR);
-        if (mkfs.fd < 0) {
+// Copy a file, possibly from one image to another.
+void do_cp(char *s)
+{
+        char paths[2][64];
+        char *path[2];
+        struct fs_mount *m[2];
+        for (int i = 0; i < 2; i++) {
+                if (!(s = nextword(s, paths[i]))) {
+                        printf("usage: cp <path> <path>\n");
+                        return;
+                }
+                if (!(m[i] = getmount(paths[i], &path[i]))) return;
+        }
+        uint32_t from = fs_lookup(m[0], path[0]);
+        if (from == NULLINUM) {
+                printf("cp: %s: No such file or directory\n", paths[0]);
+                return;
+        }
+        struct dinode di;
+        if (fs_geti(m[0], from, &di) < 0) return;
+        if (ITYPE(&di) != T_REG) {
+                printf("cp: %s: Not a regular file\n", paths[0]);
+                return;
+        }
+        uint32_t to = create(m[1], path[1], di.type), off = 0, end;
+        if (to == NULLINUM) return;
+        // Holes in the file are left as holes in the copy.
+        while (nextdata(m[0], from, &off, &end))
+                for (int n; off < end; off += n) {
+                        char buf[CHUNK];
+                        n = fs_read(m[0], from, buf, min(CHUNK, end - off),
+                                    off);
+                        if (n <= 0 || fs_write(m[1], to, buf, n, off) != n)
+                                panic("fs error!");
+                }
+        if (fs_truncate(m[1], to, di.size) < 0) panic("fs error!");
+}
+
+void do_clone(char *s)
+{
+        char paths[2][64];
+        char *path[2];
+        struct fs_mount *m[2];
+        for (int i = 0; i < 2; i++) {
+                if (!(s = nextword(s, paths[i]))) {
+                        printf("usage: clone <path> <path>\n");
+                        return;
+                }
+                if (!(m[i] = getmount(paths[i], &path[i]))) return;
+        }
+        if (m[0] != m[1]) {
+                printf("clone: %s: Not on the same image\n", paths[1]);
+                return;
+        }
+        uint32_t from = fs_lookup(m[0], path[0]);
+        if (from == NULLINUM) {
+                printf("clone: %s: No such file or directory\n", paths[0]);
+                return;
+        }
+        // An existing file is replaced, as with migrate and cp.
+        if (fs_lookup(m[1], path[1]) != NULLINUM &&
+            fs_unlink(m[1], path[1]) < 0)
+                return;
+        fs_clone(m[1], from, path[1]);
+}
+
+void do_stat(char *s)
+{
+        char w[64];
+        int n = 0;
+        struct fs_stats st;
+        if (nextword(s, w)) n = atoi(w);
+        if (n < 0 || n >= NIMAGE || !mkfs.images[n].m) {
+                printf("stat: %s: no such image\n", w);
+                return;
+        }
+        fs_getstats(mkfs.images[n].m, &st);
+        printf("disk reads: %u\n", st.nread);
+        printf("disk writes: %u\n", st.nwrite);
+        printf("disk requests: %u\n", st.nreq);
+        printf("cache hits: %u\n", st.nhit);
+        printf("cache misses: %u\n", st.nmiss);
+        printf("block map hits: %u\n", st.nmaphit);
+        printf("block map misses: %u\n", st.nmapmiss);
+        printf("blocks read ahead: %u\n", st.nra);
+        printf("read-ahead hits: %u\n", st.nrahit);
+        printf("name cache hits: %u\n", st.nnamehit);
+        printf("name cache misses: %u\n", st.nnamemiss);
+        printf("log commits: %u\n", st.ncommit);
+        printf("blocks discarded: %u\n", st.ndiscard);
+}
+
+// Print how much work the fs did since 'st0' was taken.
+static void bench_report(struct fs_mount *m, char *phase,
+                         struct fs_stats *st0)
+{
+        struct fs_stats st;
+        fs_getstats(m, &st);
+        printf("%s: %u disk reads, %u disk writes, %u disk requests, "
+               "%u block lookups, %u/%u block map hits/misses, "
+               "%u/%u read-ahead hits/blocks\n",
+               phase, st.nread - st0->nread, st.nwrite - st0->nwrite,
+               st.nreq - st0->nreq, st.nhit + st.nmiss - st0->nhit - st0->nmiss,
+               st.nmaphit - st0->nmaphit, st.nmapmiss - st0->nmapmiss,
+               st.nrahit - st0->nrahit, st.nra - st0->nra);
+        *st0 = st;
+}
+
+// Read every file under directory 'inum,' listing each directory with the
+// inodes of its entries prefetched like ls -l does.
+static void read_tree(struct fs_mount *m, uint32_t inum)
+{
+        struct fs_dir dir;
+        struct dirent des[NDIRENTS_PER_BLOCK];
+        struct dinode di;
+        char buf[CHUNK];
+        int n;
+        if (fs_opendir(m, inum, &dir, FS_DIR_STAT) < 0) return;
+        while ((n = fs_readdir(m, &dir, des, NDIRENTS_PER_BLOCK)) > 0)
+                for (int i = 0; i < n; i++) {
+                        if (fs_geti(m, des[i].inum, &di) < 0) continue;
+                        if (ITYPE(&di) == T_DIR) {
+                                read_tree(m, des[i].inum);
+                                continue;
+                        }
+                        for (uint32_t off = 0; off < di.size; off += CHUNK)
+                                fs_read(m, des[i].inum, buf, CHUNK, off);
+                }
+}
+
+// Read the tree under directory 'inum' of image 'img' from a cold cache and
+// report the cost, along with the number of cylinder changes.
+static void bench_tree(struct image *img, uint32_t inum)
+{
+        struct fs_stats st;
+        // Remounting drops every cached block.
+        if (fs_init(img->m, &img->part) < 0) return;
+        fs_getstats(img->m, &st);
+        img->nseek = 0;
+        read_tree(img->m, inum);
+        bench_report(img->m, "tree", &st);
+        printf("tree: %u cylinder changes\n", img->nseek);
+}
+
+// Return the block size of the file system of image 'img.'
+static uint32_t blocksize(struct image *img)
+{
+        union block b;
+        off_t off = (off_t)img->part.startlba * BLOCKSIZE;
+        assert(pread(img->fd, &b, BLOCKSIZE, off) == BLOCKSIZE);
+        return b.su.blocksize ? b.su.blocksize : BLOCKSIZE;
+}
+
+// Read a file block by block, front to back and then at random offsets, and
+// report the cost of each pass. For a directory, read the whole tree under
+// it instead.
+void do_bench(char *s)
+{
+        char arg[64];
+        char *path;
+        char buf[MAXBLOCKSIZE];
+        struct fs_stats st;
+        struct fs_mount *m;
+        struct image *img = 0;
+        if (!nextword(s, arg)) {
+                printf("usage: bench <path>\n");
+                return;
+        }
+        if (!(m = getmount(arg, &path))) return;
+        for (int i = 0; i < NIMAGE; i++)
+                if (mkfs.images[i].m == m) img = &mkfs.images[i];
+        uint32_t inum = fs_lookup(m, path);
+        if (inum == NULLINUM) {
+                printf("bench: %s: No such file or directory\n", arg);
+                return;
+        }
+        struct dinode di;
+        if (fs_geti(m, inum, &di) < 0) return;
+        if (ITYPE(&di) == T_DIR) {
+                bench_tree(img, inum);
+                return;
+        }
+        uint32_t bsize = blocksize(img);
+        uint32_t nblocks = (di.size + bsize - 1) / bsize;
+        if (!nblocks) return;
+        fs_getstats(m, &st);
+        for (uint32_t i = 0; i < nblocks; i++)
+                fs_read(m, inum, buf, bsize, i * bsize);
+        bench_report(m, "sequential", &st);
+        srand(1);
+        for (uint32_t i = 0; i < nblocks; i++)
+                fs_read(m, inum, buf, bsize, rand() % nblocks * bsize);
+        bench_report(m, "random", &st);
+}
+
+// Format the partition of image 'img' with blocks of 'bsize' bytes and mount
+// it. Unless 'flags' has FS_FORMAT_ZERO, the fs discards the partition, which
+// disk_discard() punches out of the image file, so that a fresh image stays
+// sparse and no stale data is left in it. Return -1 on failure.
+static int format(struct image *img, uint32_t bsize, int flags)
+{
+        if (fs_format(img->m, &img->part, bsize, flags) < 0) return -1;
+        assert(fs_init(img->m, &img->part) >= 0);
+        return 0;
+}
+
+// Open partition 'partnum' of image 'name,' formatting it with blocks of
+// 'bsize' bytes if there's no file system in it yet, as image number 'n.'
+// Return -1 on failure.
+static int open_image(int n, char *name, char *partnum, uint32_t bsize)
+{
+        struct image *img = &mkfs.images[n];
+        img->fd = open(name, O_RDWR);
+        if (img->fd < 0) {
                 perror("open");
-                exit(1);
+                return -1;
         }
 
-        int n = atoi(argv[2]);
-        if (strlen(argv[2]) != 1 || !isnumber(argv[2][0]) || n < 1 || n > 4) {
+        int y = atoi(partnum);
+        if (strlen(partnum) != 1 || !isnumber(partnum[0]) || y < 1 || y > 4) {
                 fprintf(stderr, "mkfs: %s: invalid partition number\n",
-                        argv[2]);
-                exit(1);
+                        partnum);
+                close(img->fd);
+                return -1;
         }
 
         union block b;
         // Read the first sector and assume it's the mbr
-        disk_read(0, &b);
+        disk_read(img, 0, &b);
         if (*(uint16_t *)&b.bytes[510] != 0xaa55) {
                 fprintf(stderr, "missing MBR\n");
-                exit(1);
+                close(img->fd);
+                return -1;
         }
         // Retrieve the partition table from the mbr
         struct partition partble[4];
@@ -236,18 +652,103 @@ int main(int argc, char *argv[])
                                  sizeof(struct partition) * 4);
         for (int i = 0; i < 4; partble[i++] = *p++)
                 ;
-        // Does the specified partition number 'n' points to a valid partition
+        // Does the specified partition number 'y' points to a valid partition
         // with a non-zero 'sysid'
-        if (!partble[n - 1].sysid) {
-                fprintf(stderr, "partition %d is empty", n);
-                exit(1);
+        if (!partble[y - 1].sysid) {
+                fprintf(stderr, "partition %d is empty", y);
+                close(img->fd);
+                return -1;
+        }
+
+        if (!(img->m = fs_open(img, disk_read, disk_write, printf))) {
+                fprintf(stderr, "mkfs: too many mounts\n");
+                close(img->fd);
+                return -1;
+        }
+        fs_setrange(img->m, disk_readv, disk_writev);
+        fs_setdiscard(img->m, disk_discard);
+        img->part = partble[y - 1];
+        if (fs_init(img->m, &img->part) < 0 && format(img, bsize, 0) < 0) {
+                fs_close(img->m);
+                img->m = 0;
+                close(img->fd);
+                return -1;
+        }
+        return 0;
+}
+
+void do_open(char *s)
+{
+        char args[3][64] = {0};
+        int n;
+        for (int i = 0; i < 2; i++) {
+                if (!(s = nextword(s, args[i]))) {
+                        printf("usage: open <vhd_name> <partition_num> "
+                               "[block_size]\n");
+                        return;
+                }
+        }
+        nextword(s, args[2]);
+        for (n = 0; n < NIMAGE && mkfs.images[n].m; n++)
+                ;
+        if (n == NIMAGE) {
+                printf("open: too many images\n");
+                return;
+        }
+        if (open_image(n, args[0], args[1], atoi(args[2])) < 0) return;
+        printf("%d\n", n);
+}
+
+// Write back and close every open image.
+static void close_all()
+{
+        for (int i = 0; i < NIMAGE; i++) {
+                if (!mkfs.images[i].m) continue;
+                fs_close(mkfs.images[i].m);
+                close(mkfs.images[i].fd);
+                mkfs.images[i].m = 0;
         }
+}
 
-        if (fs_init(&partble[n - 1], disk_read, disk_write, printf) < 0) {
-                fs_format(&partble[n - 1]);
-                assert(fs_init(&partble[n - 1], disk_read, disk_write,
-                               printf) >= 0);
+// Reformat an open image, erasing everything in it. With "zero," every block
+// of the partition is written with zeros. With "groups," the file system is
+// laid out in block groups.
+void do_format(char *s)
+{
+        char args[4][64] = {0};
+        int flags = 0;
+        uint32_t bsize = 0;
+        for (int i = 0; i < 4 && s; i++)
+                s = nextword(s, args[i]);
+        int n = atoi(args[0]);
+        if (!args[0][0] || n < 0 || n >= NIMAGE || !mkfs.images[n].m) {
+                printf("usage: format <image_num> [block_size] [zero] "
+                       "[groups]\n");
+                return;
         }
+        // The block size may be left out before the options.
+        for (int i = 1; i < 4; i++)
+                if (!strcmp(args[i], "zero"))
+                        flags |= FS_FORMAT_ZERO;
+                else if (!strcmp(args[i], "groups"))
+                        flags |= FS_FORMAT_GROUPS;
+                else if (args[i][0])
+                        bsize = atoi(args[i]);
+        if (format(&mkfs.images[n], bsize, flags) < 0)
+                printf("format: %d: failed\n", n);
+}
+
+int main(int argc, char *argv[])
+{
+        if (argc < 3) {
+                fprintf(stderr, "usage: main <vhd_name> <partition_num> "
+                                "[block_size]\n");
+                exit(1);
+        }
+
+        // The block size only matters if the partition is formatted.
+        if (open_image(0, argv[1], argv[2], argc > 3 ? atoi(argv[3]) : 0) < 0)
+                exit(1);
         for (;;) {
                 char s[64], w[64];
                 printf("> "), fflush(stdout);
@@ -269,8 +770,30 @@ int main(int argc, char *argv[])
                         do_mkdir(p);
                 else if (!strncmp("touch", w, 5))
                         do_touch(p);
-                else if (!strncmp("quit", w, 4))
+                else if (!strncmp("rm", w, 2))
+                        do_rm(p);
+                else if (!strncmp("cp", w, 2))
+                        do_cp(p);
+                else if (!strncmp("clone", w, 5))
+                        do_clone(p);
+                else if (!strncmp("compact", w, 7))
+                        do_compact(p);
+                else if (!strncmp("open", w, 4))
+                        do_open(p);
+                else if (!strncmp("format", w, 6))
+                        do_format(p);
+                else if (!strncmp("sync", w, 4)) {
+                        for (int i = 0; i < NIMAGE; i++)
+                                if (mkfs.images[i].m) fs_sync(mkfs.images[i].m);
+                }
+                else if (!strncmp("stat", w, 4))
+                        do_stat(p);
+                else if (!strncmp("bench", w, 5))
+                        do_bench(p);
+                else if (!strncmp("quit", w, 4)) {
+                        close_all();
                         exit(0);
+                }
                 else
                         printf("mkfs: %s: invalid command\n", w);
         }